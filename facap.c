@@ -0,0 +1,376 @@
+// facap, converts the binary capture of gpgnet-mock --record to the .csv log
+//
+//   facap [--from ms] [--to ms] [--messages] capture.bin > log.csv
+//   facap --import log.csv capture.bin      the .csv log of the older gpgnet-mock
+//   facap --bench-hex mb                    hex encode/decode throughput
+#include "facap.h"
+#include "hex.h"
+#include "mpmsg.h"
+#include <stdlib.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define MP_CON 0
+#define MP_ANS 1
+#define MP_DAT 4
+#define MP_ACK 5
+#define MP_KPA 6
+#define MP_GBY 7
+
+struct MPHeader {
+    u8  type;
+    u32 mask;
+    u16 ser;
+    u16 irt;
+    u16 seq;
+    u16 expected;
+    u16 len;
+    u8  data[0];
+} __attribute__((packed));
+
+static u64 s_from = 0;
+static u64 s_to = UINT64_MAX;
+static bool s_messages;
+
+#define MAX_DIRECTIONS 256
+
+// --messages, the decoder of every src -> dst
+static struct Direction {
+    u16 src, dst;
+    struct MPStream stream;
+} s_directions[MAX_DIRECTIONS];
+static int s_num_directions;
+
+static bool
+read_record(FILE *fp, struct CapRecord *r, void *body, size_t size)
+{
+    if (fread(r, sizeof(*r), 1, fp) != 1 || r->len < sizeof(*r))
+        return false;
+    size_t len = r->len - sizeof(*r);
+    if (len > size)
+        return false;
+    return len == 0 || fread(body, len, 1, fp) == 1;
+}
+
+// the offset of the first packet that may be at or after `from`, the index
+// chain is walked back from the trailer, 0 - no trailer, scan the file
+static u64
+seek_from(FILE *fp, u64 from)
+{
+    struct CapRecord r;
+    struct CapTrailer t;
+    if (cap_seek(fp, -(int64_t)(sizeof(r) + sizeof(t)), SEEK_END) != 0 ||
+        !read_record(fp, &r, &t, sizeof(t)) || r.kind != CAP_TRAILER)
+        return 0;
+    u64 first = 0;
+    for (u64 at = t.last_index; at; ) {
+        struct CapIndex idx;
+        if (cap_seek(fp, (int64_t)at, SEEK_SET) != 0 || !read_record(fp, &r, &idx, sizeof(idx)) ||
+            r.kind != CAP_INDEX)
+            return 0;
+        if (idx.last_time < from)
+            break;
+        first = idx.first;
+        at = idx.prev;
+    }
+    return first;
+}
+
+static const char *
+mp_name(u8 type)
+{
+    return type == MP_CON ? "CON" :
+        type == MP_ANS ? "ANS" :
+        type == MP_DAT ? "DAT" :
+        type == MP_ACK ? "ACK" :
+        type == MP_KPA ? "KPA" :
+        type == MP_GBY ? "GBY" : "UNK";
+}
+
+static int
+mp_type(const char *name)
+{
+    static const char *names[] = { "CON", "ANS", "", "", "DAT", "ACK", "KPA", "GBY" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (*names[i] && strcmp(names[i], name) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+static void
+print_packet(const struct CapRecord *r, const u8 *data, size_t len)
+{
+    static char hex[2 * 65536 + 1];
+    const struct MPHeader *h = (const struct MPHeader *)data;
+    if (len < sizeof(*h))
+        return;
+    size_t n = h->len;
+    if (n > len - sizeof(*h))
+        n = len - sizeof(*h);
+    hex_encode(hex, h->data, n);
+    hex[2 * n] = 0;
+    printf("%u\t%u\t%u\t%s\t%u\t%u\t%u\t%u\t%u\tx'%s'\n",
+        (u32)(r->time / 1000000), r->src, r->dst, mp_name(h->type), h->mask, h->ser, h->irt,
+        h->seq, h->expected, hex);
+}
+
+// the .csv log back into a capture, UNK packets are lost, their type is not in the log,
+// the header row tells whether there is a mask column
+static int
+import_csv(const char *csv, const char *capture)
+{
+    static char line[2 * 65536 + 256];
+    static u8 packet[sizeof(struct MPHeader) + 65536];
+    struct MPHeader *h = (struct MPHeader *)packet;
+    FILE *fp = fopen(csv, "r");
+    if (!fp) {
+        perror(csv);
+        return EXIT_FAILURE;
+    }
+    struct CapWriter w;
+    if (!cap_open(&w, capture, 0)) {
+        perror(capture);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    bool has_mask = false;
+    if (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        has_mask = strcmp(line, CAP_CSV_COLUMNS) == 0;
+        if (!has_mask && strcmp(line, CAP_CSV_COLUMNS_NO_MASK) != 0) {
+            fprintf(stderr, "%s: not a .csv log, unknown columns %s\n", csv, line);
+            fclose(fp);
+            cap_close(&w);
+            return EXIT_FAILURE;
+        }
+    }
+    unsigned long long skipped = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned ts, src, dst, mask = 0, ser, irt, seq, expected;
+        char name[8];
+        int end = 0;
+        int fields = has_mask ?
+            sscanf(line, "%u\t%u\t%u\t%7s\t%u\t%u\t%u\t%u\t%u\tx'%n",
+                &ts, &src, &dst, name, &mask, &ser, &irt, &seq, &expected, &end) :
+            sscanf(line, "%u\t%u\t%u\t%7s\t%u\t%u\t%u\t%u\tx'%n",
+                &ts, &src, &dst, name, &ser, &irt, &seq, &expected, &end) + 1;
+        if (fields != 9 || !end) {
+            skipped++;
+            continue;
+        }
+        const char *hex = line + end;
+        const char *quote = strchr(hex, '\'');
+        int type = mp_type(name);
+        size_t n = quote ? (size_t)(quote - hex) / 2 : 0;
+        if (!quote || (quote - hex) % 2 || type < 0 || !hex_decode(h->data, hex, n)) {
+            skipped++;
+            continue;
+        }
+        *h = (struct MPHeader){
+            .type = (u8)type, .mask = mask, .ser = (u16)ser, .irt = (u16)irt,
+            .seq = (u16)seq, .expected = (u16)expected, .len = (u16)n,
+        };
+        cap_packet(&w, (u64)ts * 1000000, (u16)src, (u16)dst, packet, sizeof(*h) + n);
+    }
+    fclose(fp);
+    cap_close(&w);
+    fprintf(stderr, "%s: %llu packets, %llu lines skipped\n", capture,
+        (unsigned long long)w.packets, skipped);
+    return 0;
+}
+
+static u64
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+}
+
+static void
+snprintf_encode(char *dst, const u8 *src, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        snprintf(dst + 2 * i, 3, "%02X", src[i]);
+}
+
+// --bench-hex, mb of packet sized chunks through every version, GB/s of bytes
+static int
+bench_hex(size_t mb)
+{
+    struct {
+        const char *name;
+        void (*encode)(char *dst, const u8 *src, size_t n);
+        bool (*decode)(u8 *dst, const char *src, size_t n);
+    } impls[] = {
+        { "snprintf", snprintf_encode, NULL },
+        { "scalar", hex_encode_scalar, hex_decode_scalar },
+#if defined(__x86_64__)
+        { "sse2", hex_encode_sse2, hex_decode_sse2 },
+        { "avx2", hex_encode_avx2, hex_decode_avx2 },
+#endif
+    };
+    size_t size = mb * 1024 * 1024, chunk = 1400;
+    u8 *src = (u8 *)malloc(size), *back = (u8 *)malloc(size);
+    char *hex = (char *)malloc(2 * size + 1);
+    if (!src || !back || !hex)
+        return EXIT_FAILURE;
+    for (size_t i = 0; i < size; ++i)
+        src[i] = (u8)(i * 2654435761u >> 13);
+    hex_init();
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k) {
+#if defined(__x86_64__)
+        if (impls[k].encode == hex_encode_avx2 && !__builtin_cpu_supports("avx2"))
+            continue;
+#endif
+        memset(back, 0, size);
+        u64 t0 = now_ns();
+        for (size_t i = 0; i < size; i += chunk)
+            impls[k].encode(hex + 2 * i, src + i, size - i < chunk ? size - i : chunk);
+        u64 t1 = now_ns();
+        bool ok = true;
+        if (impls[k].decode) {
+            for (size_t i = 0; i < size; i += chunk)
+                ok &= impls[k].decode(back + i, hex + 2 * i, size - i < chunk ? size - i : chunk);
+        }
+        u64 t2 = now_ns();
+        ok &= !impls[k].decode || memcmp(src, back, size) == 0;
+        printf("%-8s encode %6.2f GB/s", impls[k].name, size / ((t1 - t0) / 1e9) / 1e9);
+        if (impls[k].decode)
+            printf("  decode %6.2f GB/s%s", size / ((t2 - t1) / 1e9) / 1e9, ok ? "" : "  MISMATCH");
+        printf("\n");
+    }
+    free(src);
+    free(back);
+    free(hex);
+    return 0;
+}
+
+static struct MPStream *
+direction_stream(u16 src, u16 dst)
+{
+    for (int i = 0; i < s_num_directions; ++i) {
+        if (s_directions[i].src == src && s_directions[i].dst == dst)
+            return &s_directions[i].stream;
+    }
+    if (s_num_directions == MAX_DIRECTIONS)
+        return NULL;
+    struct Direction *d = &s_directions[s_num_directions++];
+    d->src = src;
+    d->dst = dst;
+    return &d->stream;
+}
+
+static u32
+read_u32(const u8 *p)
+{
+    return (u32)p[0] | (u32)p[1] << 8 | (u32)p[2] << 16 | (u32)p[3] << 24;
+}
+
+// a row under the packet, the messages it completes, resends have none
+static void
+print_message(void *arg, u8 type, const u8 *data, size_t len)
+{
+    (void)arg;
+    if (type == 0x32 && len >= 5)
+        printf(" -- %#02x %u %u\n", type, data[0], read_u32(data + 1));
+    else if ((type == 0x33 || type == 0x34 || type == 0x00) && len >= 4)
+        printf(" -- %#02x   %u\n", type, read_u32(data));
+    else
+        printf(" -- %#02x   %u bytes\n", type, (unsigned)len);
+}
+
+static void
+print_messages(const struct CapRecord *r, const u8 *data, size_t len)
+{
+    const struct MPHeader *h = (const struct MPHeader *)data;
+    if (len < sizeof(*h) || h->type != MP_DAT)
+        return;
+    struct MPStream *s = direction_stream(r->src, r->dst);
+    size_t n = len - sizeof(*h) < h->len ? len - sizeof(*h) : h->len;
+    if (s && !s->broken && !mps_packet(s, h->seq, h->data, n, print_message, NULL))
+        fprintf(stderr, "%u -> %u: seq=%u doesn't decode, the stream is out of sync\n", r->src, r->dst, h->seq);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "%s usage: [options] capture\n"
+        "--help                           show help message\n"
+        "--from ms                        skip packets captured before ms\n"
+        "--to ms                          stop after ms\n"
+        "--messages                       the MPMsg of the MP_DAT payloads under the packets\n"
+        "--import csv capture             convert the .csv log to a capture\n"
+        "--bench-hex mb                   hex encode/decode throughput\n",
+        prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *filename = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--from", argv[i]) == 0 && i + 1 < argc) {
+            s_from = strtoull(argv[++i], NULL, 10) * 1000000;
+        } else if (strcmp("--to", argv[i]) == 0 && i + 1 < argc) {
+            s_to = strtoull(argv[++i], NULL, 10) * 1000000;
+        } else if (strcmp("--messages", argv[i]) == 0) {
+            s_messages = true;
+        } else if (strcmp("--import", argv[i]) == 0 && i + 2 < argc) {
+            return import_csv(argv[i + 1], argv[i + 2]);
+        } else if (strcmp("--bench-hex", argv[i]) == 0 && i + 1 < argc) {
+            return bench_hex(strtoull(argv[i + 1], NULL, 10));
+        } else if (argv[i][0] != '-' && !filename) {
+            filename = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!filename)
+        usage(argv[0]);
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        perror(filename);
+        return EXIT_FAILURE;
+    }
+    setvbuf(fp, NULL, _IOFBF, CAP_BUFFER_SIZE);
+    struct CapFileHeader fh;
+    if (fread(&fh, sizeof(fh), 1, fp) != 1 || memcmp(fh.magic, CAP_MAGIC, sizeof(fh.magic)) != 0 ||
+        fh.version != CAP_VERSION) {
+        fprintf(stderr, "%s: not a capture file\n", filename);
+        return EXIT_FAILURE;
+    }
+    u64 first = s_from ? seek_from(fp, s_from) : 0;
+    cap_seek(fp, first ? (int64_t)first : (int64_t)sizeof(fh), SEEK_SET);
+    printf(CAP_CSV_COLUMNS "\n");
+    static u8 body[65536 + sizeof(struct CapIndex)];
+    struct CapRecord r;
+    u64 packets = 0;
+    for (;;) {
+        if (!read_record(fp, &r, body, sizeof(body))) {
+            // a capture of a killed gpgnet-mock ends without the trailer
+            if (!feof(fp))
+                fprintf(stderr, "%s: broken record after %llu packets\n", filename, (unsigned long long)packets);
+            break;
+        }
+        if (r.kind == CAP_TRAILER || (r.kind == CAP_PACKET && r.time > s_to))
+            break;
+        if (r.kind != CAP_PACKET || r.time < s_from)
+            continue;
+        print_packet(&r, body, r.len - sizeof(r));
+        if (s_messages)
+            print_messages(&r, body, r.len - sizeof(r));
+        packets++;
+    }
+    fclose(fp);
+    for (int i = 0; i < s_num_directions; ++i)
+        mps_free(&s_directions[i].stream);
+    return 0;
+}
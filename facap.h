@@ -0,0 +1,294 @@
+// Binary packet capture, gpgnet-mock --record writes it, facap converts it
+// to the .csv log.
+//
+//   file     CapFileHeader, records
+//   record   CapRecord, then len - sizeof(CapRecord) bytes of body
+//   packet   the datagram as the game sent it, MPHeader and payload
+//   index    CapIndex, after every CAP_INDEX_PACKETS packets
+//   trailer  CapTrailer, the last record of a file closed properly
+//
+// The index records are chained from the trailer backwards, a reader seeks
+// by time without reading the packets. All integers are little endian.
+//
+// CapQueue hands the packets from the packet loop to the thread that owns
+// the CapWriter, a full queue drops the packet instead of waiting for disk.
+#ifndef FACAP_H
+#define FACAP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <sys/types.h>
+#endif
+
+#define CAP_MAGIC "FACAP\r\n\x1a"
+#define CAP_VERSION 1
+#define CAP_INDEX_PACKETS 4096
+#define CAP_BUFFER_SIZE (1024 * 1024)
+#define CAP_QUEUE_SIZE (8 * 1024 * 1024)  // bytes, power of two
+
+// the header row of the .csv log, the log.csv in the repo and the README
+// sqlite table have no mask column
+#define CAP_CSV_COLUMNS "ts\tsrc\tdst\ttype\tmask\tser\tirt\tseq\texpected\tdata"
+#define CAP_CSV_COLUMNS_NO_MASK "ts\tsrc\tdst\ttype\tser\tirt\tseq\texpected\tdata"
+
+enum CapKind {
+    CAP_PACKET = 1,
+    CAP_INDEX,
+    CAP_TRAILER,
+};
+
+struct CapFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct CapRecord {
+    uint32_t len;           // the whole record
+    uint8_t kind;           // enum CapKind
+    uint8_t reserved;
+    uint16_t src;           // ports, packets only
+    uint16_t dst;
+    uint16_t reserved2;
+    uint64_t time;          // ns since the file start
+} __attribute__((packed));
+
+// the block of packets that ends with the index record
+struct CapIndex {
+    uint64_t prev;          // file offset of the previous index record, 0 - the first one
+    uint64_t first;         // file offset of the first packet of the block
+    uint64_t first_time;
+    uint64_t last_time;
+    uint32_t packets;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct CapTrailer {
+    uint64_t last_index;    // file offset, 0 - no index records
+    uint64_t packets;
+} __attribute__((packed));
+
+struct CapWriter {
+    FILE *fp;
+    uint64_t start;         // ns, the clock of the caller
+    uint64_t offset;        // bytes written
+    uint64_t packets;
+    uint64_t last_index;
+    uint64_t last_time;
+    struct CapIndex block;  // the block being written
+};
+
+// a capture is often larger than 2GB, `long` of fseek() is 32 bits on Windows
+static inline int
+cap_seek(FILE *fp, int64_t offset, int whence)
+{
+#if defined(_WIN32)
+    return _fseeki64(fp, offset, whence);
+#else
+    return fseeko(fp, (off_t)offset, whence);
+#endif
+}
+
+static inline int64_t
+cap_tell(FILE *fp)
+{
+#if defined(_WIN32)
+    return _ftelli64(fp);
+#else
+    return (int64_t)ftello(fp);
+#endif
+}
+
+static inline bool
+cap_write(struct CapWriter *w, uint8_t kind, uint64_t time, uint16_t src, uint16_t dst,
+    const void *body, size_t len)
+{
+    struct CapRecord r = {
+        .len = (uint32_t)(sizeof(r) + len),
+        .kind = kind,
+        .src = src,
+        .dst = dst,
+        .time = time,
+    };
+    if (fwrite(&r, sizeof(r), 1, w->fp) != 1 || (len && fwrite(body, len, 1, w->fp) != 1))
+        return false;
+    w->offset += r.len;
+    return true;
+}
+
+static inline bool
+cap_open(struct CapWriter *w, const char *path, uint64_t now)
+{
+    memset(w, 0, sizeof(*w));
+    if ((w->fp = fopen(path, "wb")) == NULL)
+        return false;
+    setvbuf(w->fp, NULL, _IOFBF, CAP_BUFFER_SIZE);
+    struct CapFileHeader h = { .version = CAP_VERSION };
+    memcpy(h.magic, CAP_MAGIC, sizeof(h.magic));
+    if (fwrite(&h, sizeof(h), 1, w->fp) != 1) {
+        fclose(w->fp);
+        w->fp = NULL;
+        return false;
+    }
+    w->offset = sizeof(h);
+    w->start = now;
+    return true;
+}
+
+static inline void
+cap_index(struct CapWriter *w)
+{
+    uint64_t offset = w->offset;
+    struct CapIndex *b = &w->block;
+    b->prev = w->last_index;
+    if (cap_write(w, CAP_INDEX, b->last_time, 0, 0, b, sizeof(*b)))
+        w->last_index = offset;
+    memset(b, 0, sizeof(*b));
+}
+
+// a datagram from port src to port dst at now (the clock of cap_open)
+static inline void
+cap_packet(struct CapWriter *w, uint64_t now, uint16_t src, uint16_t dst, const void *data, size_t len)
+{
+    uint64_t time = now - w->start;
+    struct CapIndex *b = &w->block;
+    if (!b->packets) {
+        b->first = w->offset;
+        b->first_time = time;
+    }
+    if (!cap_write(w, CAP_PACKET, time, src, dst, data, len))
+        return;
+    b->last_time = w->last_time = time;
+    w->packets++;
+    if (++b->packets == CAP_INDEX_PACKETS)
+        cap_index(w);
+}
+
+static inline void
+cap_close(struct CapWriter *w)
+{
+    if (!w->fp)
+        return;
+    if (w->block.packets)
+        cap_index(w);
+    struct CapTrailer t = { .last_index = w->last_index, .packets = w->packets };
+    cap_write(w, CAP_TRAILER, w->last_time, 0, 0, &t, sizeof(t));
+    fclose(w->fp);
+    w->fp = NULL;
+}
+
+// Lock-free SPSC byte ring of CapRecord with the packet after each one, the
+// time is the `now` of the producer. A record that does not fit before the
+// end of the ring leaves the rest of it as padding, a CapRecord with kind 0
+// when there is room for one, and starts again at 0.
+struct CapQueue {
+    atomic_ullong head;             // bytes pushed, the producer only
+    char pad[56];
+    atomic_ullong tail;             // bytes popped, the consumer only
+    char pad2[56];
+    uint64_t tail_cache;            // the producer copy of tail
+    uint64_t pushed;
+    atomic_ullong dropped;
+    atomic_ullong max_fill;         // bytes, seen by the consumer
+    uint8_t *buf;
+};
+
+static inline bool
+cap_queue_init(struct CapQueue *q)
+{
+    memset(q, 0, sizeof(*q));
+    q->buf = (uint8_t *)malloc(CAP_QUEUE_SIZE);
+    if (!q->buf)
+        return false;
+    memset(q->buf, 0, CAP_QUEUE_SIZE);  // fault the pages in now, not on the packet path
+    return true;
+}
+
+static inline void
+cap_queue_free(struct CapQueue *q)
+{
+    free(q->buf);
+    q->buf = NULL;
+}
+
+static inline size_t
+cap_queue_fill(struct CapQueue *q)
+{
+    return (size_t)(atomic_load_explicit(&q->head, memory_order_relaxed) -
+        atomic_load_explicit(&q->tail, memory_order_relaxed));
+}
+
+// the producer, false - the queue is full and the packet is dropped
+static inline bool
+cap_queue_push(struct CapQueue *q, uint64_t now, uint16_t src, uint16_t dst, const void *data, size_t len)
+{
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t need = (sizeof(struct CapRecord) + len + 7) & ~(size_t)7;
+    size_t pos = head & (CAP_QUEUE_SIZE - 1);
+    size_t skip = CAP_QUEUE_SIZE - pos < need ? CAP_QUEUE_SIZE - pos : 0;
+    if (head + skip + need - q->tail_cache > CAP_QUEUE_SIZE) {
+        q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (head + skip + need - q->tail_cache > CAP_QUEUE_SIZE) {
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+    if (skip) {
+        if (skip >= sizeof(struct CapRecord)) {
+            struct CapRecord pad = { .len = (uint32_t)skip };
+            memcpy(q->buf + pos, &pad, sizeof(pad));
+        }
+        head += skip;
+        pos = 0;
+    }
+    struct CapRecord r = {
+        .len = (uint32_t)(sizeof(r) + len),
+        .kind = CAP_PACKET,
+        .src = src,
+        .dst = dst,
+        .time = now,
+    };
+    memcpy(q->buf + pos, &r, sizeof(r));
+    memcpy(q->buf + pos + sizeof(r), data, len);
+    head += need;
+    q->pushed++;
+    atomic_store_explicit(&q->head, head, memory_order_release);
+    return true;
+}
+
+// the consumer, writes everything queued so far, returns the packet count
+static inline size_t
+cap_queue_drain(struct CapQueue *q, struct CapWriter *w)
+{
+    uint64_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t packets = 0;
+    if (head - tail > atomic_load_explicit(&q->max_fill, memory_order_relaxed))
+        atomic_store_explicit(&q->max_fill, head - tail, memory_order_relaxed);
+    while (tail < head) {
+        size_t pos = tail & (CAP_QUEUE_SIZE - 1);
+        size_t rest = CAP_QUEUE_SIZE - pos;
+        struct CapRecord r;
+        if (rest < sizeof(r)) {
+            tail += rest;
+            continue;
+        }
+        memcpy(&r, q->buf + pos, sizeof(r));
+        if (r.kind != CAP_PACKET) {
+            tail += r.len;
+            continue;
+        }
+        cap_packet(w, r.time, r.src, r.dst, q->buf + pos + sizeof(r), r.len - sizeof(r));
+        tail += (r.len + 7) & ~(uint32_t)7;
+        packets++;
+    }
+    atomic_store_explicit(&q->tail, tail, memory_order_release);
+    return packets;
+}
+
+#endif
@@ -0,0 +1,558 @@
+// facol, the columnar store of a capture and the queries over it
+//
+//   facol build capture.bin store.col
+//   facol query store.col [filters] [--pairs | --resends | --rows n]
+//
+// The store keeps every packet field as a packed array, the queries map the
+// file and test 16 rows at once with SSE2 instead of importing the .csv log
+// into sqlite3. The layout:
+//
+//   ColHeader, the columns at 64 byte aligned offsets, the payload heap
+//
+// `data` holds rows + 1 heap offsets, the payload of a row is between its
+// offset and the next one.
+#include "facap.h"
+#include "hex.h"
+#include <stdlib.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define COL_MAGIC "FACOL\r\n\x1a"
+#define COL_VERSION 1
+#define COL_ALIGN 64
+#define COL_BLOCK 16        // rows tested at once
+#define MAX_PORTS 256       // distinct ports in --pairs and --resends
+
+#define MP_CON 0
+#define MP_ANS 1
+#define MP_DAT 4
+#define MP_ACK 5
+#define MP_KPA 6
+#define MP_GBY 7
+
+struct MPHeader {
+    u8  type;
+    u32 mask;
+    u16 ser;
+    u16 irt;
+    u16 seq;
+    u16 expected;
+    u16 len;
+    u8  data[0];
+} __attribute__((packed));
+
+enum Column {
+    COL_TS,         // u32, ms since the capture start
+    COL_SRC,        // u16
+    COL_DST,        // u16
+    COL_TYPE,       // u8
+    COL_MASK,       // u32
+    COL_SER,        // u16
+    COL_IRT,        // u16
+    COL_SEQ,        // u16
+    COL_EXPECTED,   // u16
+    COL_DATA,       // u64, rows + 1 heap offsets
+    COLUMNS
+};
+
+static const u8 s_col_width[COLUMNS] = { 4, 2, 2, 1, 4, 2, 2, 2, 2, 8 };
+
+struct ColHeader {
+    char magic[8];
+    u32 version;
+    u32 reserved;
+    u64 rows;
+    u64 columns[COLUMNS];   // file offsets
+    u64 heap;               // file offset
+    u64 heap_size;
+} __attribute__((packed));
+
+struct ColStore {
+    const u8 *base;
+    size_t size;
+    u64 rows;
+    const u32 *ts;
+    const u16 *src;
+    const u16 *dst;
+    const u8 *type;
+    const u32 *mask;
+    const u16 *ser;
+    const u16 *irt;
+    const u16 *seq;
+    const u16 *expected;
+    const u64 *data;
+    const u8 *heap;
+};
+
+struct ColFilter {
+    int src, dst, type;     // -1 - any
+    u32 from, to;           // ms
+};
+
+static u64
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+}
+
+static const char *
+mp_name(u8 type)
+{
+    return type == MP_CON ? "CON" :
+        type == MP_ANS ? "ANS" :
+        type == MP_DAT ? "DAT" :
+        type == MP_ACK ? "ACK" :
+        type == MP_KPA ? "KPA" :
+        type == MP_GBY ? "GBY" : "UNK";
+}
+
+static int
+mp_type(const char *name)
+{
+    static const char *names[] = { "CON", "ANS", "", "", "DAT", "ACK", "KPA", "GBY" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (*names[i] && strcmp(names[i], name) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+static bool
+serial_after(u16 a, u16 b)
+{
+    return (int16_t)(a - b) > 0;
+}
+
+static u64
+col_align(u64 offset)
+{
+    return (offset + COL_ALIGN - 1) & ~(u64)(COL_ALIGN - 1);
+}
+
+static bool
+read_record(FILE *fp, struct CapRecord *r, void *body, size_t size)
+{
+    if (fread(r, sizeof(*r), 1, fp) != 1 || r->len < sizeof(*r))
+        return false;
+    size_t len = r->len - sizeof(*r);
+    if (len > size)
+        return false;
+    return len == 0 || fread(body, len, 1, fp) == 1;
+}
+
+// Two passes over the capture: the first counts the packets and the payload
+// bytes, which fixes where every column goes, the second appends to all of
+// them at once through a FILE of its own.
+static int
+build(const char *capture, const char *store)
+{
+    static u8 body[65536 + sizeof(struct CapIndex)];
+    struct CapFileHeader fh;
+    struct CapRecord r;
+    FILE *in = fopen(capture, "rb");
+    if (!in) {
+        perror(capture);
+        return EXIT_FAILURE;
+    }
+    setvbuf(in, NULL, _IOFBF, CAP_BUFFER_SIZE);
+    if (fread(&fh, sizeof(fh), 1, in) != 1 || memcmp(fh.magic, CAP_MAGIC, sizeof(fh.magic)) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", capture);
+        fclose(in);
+        return EXIT_FAILURE;
+    }
+    struct ColHeader h = { .version = COL_VERSION };
+    memcpy(h.magic, COL_MAGIC, sizeof(h.magic));
+    while (fread(&r, sizeof(r), 1, in) == 1 && r.len >= sizeof(r) && r.kind != CAP_TRAILER) {
+        if (r.kind == CAP_PACKET && r.len >= sizeof(r) + sizeof(struct MPHeader)) {
+            h.rows++;
+            h.heap_size += r.len - sizeof(r) - sizeof(struct MPHeader);
+        }
+        if (cap_seek(in, (int64_t)(r.len - sizeof(r)), SEEK_CUR) != 0)
+            break;
+    }
+    u64 offset = col_align(sizeof(h));
+    for (int i = 0; i < COLUMNS; ++i) {
+        h.columns[i] = offset;
+        offset = col_align(offset + (h.rows + (i == COL_DATA)) * s_col_width[i]);
+    }
+    h.heap = offset;
+
+    FILE *out[COLUMNS + 1];
+    for (int i = 0; i <= COLUMNS; ++i) {
+        if ((out[i] = fopen(store, i ? "r+b" : "wb")) == NULL) {
+            perror(store);
+            while (i-- > 0)
+                fclose(out[i]);
+            fclose(in);
+            return EXIT_FAILURE;
+        }
+        setvbuf(out[i], NULL, _IOFBF, i == COLUMNS ? CAP_BUFFER_SIZE : 64 * 1024);
+        if (i == 0) {
+            fwrite(&h, sizeof(h), 1, out[0]);
+            fflush(out[0]);
+        }
+        cap_seek(out[i], (int64_t)(i == COLUMNS ? h.heap : h.columns[i]), SEEK_SET);
+    }
+    cap_seek(in, (int64_t)sizeof(fh), SEEK_SET);
+    u64 rows = 0, heap = 0;
+    while (rows < h.rows && read_record(in, &r, body, sizeof(body))) {
+        const struct MPHeader *p = (const struct MPHeader *)body;
+        size_t len = r.len - sizeof(r);
+        if (r.kind != CAP_PACKET || len < sizeof(*p))
+            continue;
+        u32 ts = (u32)(r.time / 1000000);
+        u8 type = p->type;
+        u32 mask = p->mask;
+        u16 ser = p->ser, irt = p->irt, seq = p->seq, expected = p->expected;
+        fwrite(&ts, 4, 1, out[COL_TS]);
+        fwrite(&r.src, 2, 1, out[COL_SRC]);
+        fwrite(&r.dst, 2, 1, out[COL_DST]);
+        fwrite(&type, 1, 1, out[COL_TYPE]);
+        fwrite(&mask, 4, 1, out[COL_MASK]);
+        fwrite(&ser, 2, 1, out[COL_SER]);
+        fwrite(&irt, 2, 1, out[COL_IRT]);
+        fwrite(&seq, 2, 1, out[COL_SEQ]);
+        fwrite(&expected, 2, 1, out[COL_EXPECTED]);
+        fwrite(&heap, 8, 1, out[COL_DATA]);
+        fwrite(p->data, len - sizeof(*p), 1, out[COLUMNS]);
+        heap += len - sizeof(*p);
+        rows++;
+    }
+    fwrite(&heap, 8, 1, out[COL_DATA]);
+    fclose(in);
+    bool ok = rows == h.rows;
+    for (int i = 0; i <= COLUMNS; ++i)
+        ok &= fclose(out[i]) == 0;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write\n", store);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "%s: %llu rows, %llu bytes of payload\n", store,
+        (unsigned long long)h.rows, (unsigned long long)h.heap_size);
+    return 0;
+}
+
+static bool
+store_open(struct ColStore *s, const char *path)
+{
+    memset(s, 0, sizeof(*s));
+#if defined(_WIN32)
+    // no mapping on Windows, the whole store is read
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    cap_seek(fp, 0, SEEK_END);
+    s->size = (size_t)cap_tell(fp);
+    cap_seek(fp, 0, SEEK_SET);
+    u8 *buf = (u8 *)malloc(s->size ? s->size : 1);
+    bool ok = buf && fread(buf, 1, s->size, fp) == s->size;
+    fclose(fp);
+    if (!ok) {
+        free(buf);
+        return false;
+    }
+    s->base = buf;
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    s->size = (size_t)st.st_size;
+    void *base = s->size ? mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+    s->base = (const u8 *)base;
+#endif
+    const struct ColHeader *h = (const struct ColHeader *)s->base;
+    if (s->size < sizeof(*h) || memcmp(h->magic, COL_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != COL_VERSION || h->heap + h->heap_size > s->size)
+        return false;
+    for (int i = 0; i < COLUMNS; ++i) {
+        if (h->columns[i] + (h->rows + (i == COL_DATA)) * s_col_width[i] > h->heap)
+            return false;
+    }
+    s->rows = h->rows;
+    s->ts = (const u32 *)(s->base + h->columns[COL_TS]);
+    s->src = (const u16 *)(s->base + h->columns[COL_SRC]);
+    s->dst = (const u16 *)(s->base + h->columns[COL_DST]);
+    s->type = s->base + h->columns[COL_TYPE];
+    s->mask = (const u32 *)(s->base + h->columns[COL_MASK]);
+    s->ser = (const u16 *)(s->base + h->columns[COL_SER]);
+    s->irt = (const u16 *)(s->base + h->columns[COL_IRT]);
+    s->seq = (const u16 *)(s->base + h->columns[COL_SEQ]);
+    s->expected = (const u16 *)(s->base + h->columns[COL_EXPECTED]);
+    s->data = (const u64 *)(s->base + h->columns[COL_DATA]);
+    s->heap = s->base + h->heap;
+    return true;
+}
+
+static bool
+row_match(const struct ColStore *s, const struct ColFilter *f, u64 i)
+{
+    return (f->src < 0 || s->src[i] == f->src) && (f->dst < 0 || s->dst[i] == f->dst) &&
+        (f->type < 0 || s->type[i] == f->type) && s->ts[i] >= f->from && s->ts[i] <= f->to;
+}
+
+#if defined(__x86_64__)
+// 16 u16 equal to v, a bit per row
+static u32
+match_u16(const u16 *col, u16 v)
+{
+    __m128i k = _mm_set1_epi16((short)v);
+    __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)col), k);
+    __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(col + 8)), k);
+    return (u32)_mm_movemask_epi8(_mm_packs_epi16(a, b));
+}
+
+// 16 u32 in [from, to], the bias turns the signed compares into unsigned ones
+static u32
+match_range_u32(const u32 *col, u32 from, u32 to)
+{
+    const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    const __m128i all = _mm_set1_epi32(-1);
+    __m128i lo = _mm_set1_epi32((int)((from - 1) ^ 0x80000000u));
+    __m128i hi = _mm_set1_epi32((int)((to + 1) ^ 0x80000000u));
+    __m128i m[4];
+    for (int k = 0; k < 4; ++k) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(col + 4 * k)), bias);
+        // the bound is left out when from - 1 or to + 1 would wrap
+        m[k] = _mm_and_si128(from ? _mm_cmpgt_epi32(v, lo) : all,
+            to != UINT32_MAX ? _mm_cmpgt_epi32(hi, v) : all);
+    }
+    __m128i w = _mm_packs_epi16(_mm_packs_epi32(m[0], m[1]), _mm_packs_epi32(m[2], m[3]));
+    return (u32)_mm_movemask_epi8(w);
+}
+#endif
+
+// the matching rows of [i, i + COL_BLOCK), a bit per row
+static u32
+match_block(const struct ColStore *s, const struct ColFilter *f, u64 i)
+{
+#if defined(__x86_64__)
+    u32 bits = 0xffff;
+    if (f->src >= 0)
+        bits &= match_u16(s->src + i, (u16)f->src);
+    if (f->dst >= 0)
+        bits &= match_u16(s->dst + i, (u16)f->dst);
+    if (f->type >= 0) {
+        __m128i t = _mm_loadu_si128((const __m128i *)(s->type + i));
+        bits &= (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_set1_epi8((char)f->type)));
+    }
+    if (bits && (f->from > 0 || f->to < UINT32_MAX))
+        bits &= match_range_u32(s->ts + i, f->from, f->to);
+    return bits;
+#else
+    u32 bits = 0;
+    for (int k = 0; k < COL_BLOCK; ++k)
+        bits |= (u32)row_match(s, f, i + (u64)k) << k;
+    return bits;
+#endif
+}
+
+enum QueryMode {
+    QUERY_COUNT,
+    QUERY_PAIRS,
+    QUERY_RESENDS,
+    QUERY_ROWS,
+};
+
+struct Query {
+    enum QueryMode mode;
+    u64 limit;              // --rows
+    u64 count;
+    u16 port_id[65536];     // port to index + 1, 0 - not seen yet
+    u16 ports[MAX_PORTS];
+    int num_ports;
+    u64 packets[MAX_PORTS][MAX_PORTS];
+    u64 resends[MAX_PORTS][MAX_PORTS];
+    u16 last_seq[MAX_PORTS][MAX_PORTS];
+    bool seen[MAX_PORTS][MAX_PORTS];
+};
+
+static int
+port_index(struct Query *q, u16 port)
+{
+    if (!q->port_id[port]) {
+        if (q->num_ports == MAX_PORTS)
+            return -1;
+        q->ports[q->num_ports++] = port;
+        q->port_id[port] = (u16)q->num_ports;
+    }
+    return q->port_id[port] - 1;
+}
+
+static void
+print_row(const struct ColStore *s, u64 i)
+{
+    static char hex[2 * 65536 + 1];
+    size_t n = (size_t)(s->data[i + 1] - s->data[i]);
+    if (n > 65536)
+        n = 65536;
+    hex_encode(hex, s->heap + s->data[i], n);
+    hex[2 * n] = 0;
+    printf("%u\t%u\t%u\t%s\t%u\t%u\t%u\t%u\t%u\tx'%s'\n", s->ts[i], s->src[i], s->dst[i],
+        mp_name(s->type[i]), s->mask[i], s->ser[i], s->irt[i], s->seq[i], s->expected[i], hex);
+}
+
+// false - stop the scan
+static bool
+query_row(struct Query *q, const struct ColStore *s, u64 i)
+{
+    q->count++;
+    if (q->mode == QUERY_ROWS) {
+        print_row(s, i);
+        return q->count < q->limit;
+    }
+    if (q->mode == QUERY_COUNT)
+        return true;
+    int a = port_index(q, s->src[i]), b = port_index(q, s->dst[i]);
+    if (a < 0 || b < 0)
+        return true;
+    q->packets[a][b]++;
+    // a DAT that isn't after the highest seq of the pair so far was sent before
+    if (q->mode == QUERY_RESENDS && s->type[i] == MP_DAT) {
+        u16 seq = s->seq[i];
+        if (q->seen[a][b] && !serial_after(seq, q->last_seq[a][b]))
+            q->resends[a][b]++;
+        else
+            q->last_seq[a][b] = seq;
+        q->seen[a][b] = true;
+    }
+    return true;
+}
+
+static void
+query_scan(struct Query *q, const struct ColStore *s, const struct ColFilter *f)
+{
+    u64 i = 0;
+    for (; i + COL_BLOCK <= s->rows; i += COL_BLOCK) {
+        for (u32 bits = match_block(s, f, i); bits; bits &= bits - 1) {
+            if (!query_row(q, s, i + (u64)__builtin_ctz(bits)))
+                return;
+        }
+    }
+    for (; i < s->rows; ++i) {
+        if (row_match(s, f, i) && !query_row(q, s, i))
+            return;
+    }
+}
+
+static void
+query_report(struct Query *q)
+{
+    if (q->mode == QUERY_COUNT || q->mode == QUERY_ROWS) {
+        if (q->mode == QUERY_COUNT)
+            printf("%llu\n", (unsigned long long)q->count);
+        return;
+    }
+    printf(q->mode == QUERY_PAIRS ? "src\tdst\tpackets\n" : "src\tdst\tpackets\tresends\n");
+    for (int a = 0; a < q->num_ports; ++a) {
+        for (int b = 0; b < q->num_ports; ++b) {
+            if (!q->packets[a][b])
+                continue;
+            printf("%u\t%u\t%llu", q->ports[a], q->ports[b], (unsigned long long)q->packets[a][b]);
+            if (q->mode == QUERY_RESENDS)
+                printf("\t%llu", (unsigned long long)q->resends[a][b]);
+            printf("\n");
+        }
+    }
+}
+
+// 0-65535, -1 - not a port
+static int
+port_arg(const char *arg)
+{
+    char *end;
+    long port = strtol(arg, &end, 10);
+    return end == arg || *end || port < 0 || port > 65535 ? -1 : (int)port;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "%s usage:\n"
+        "build capture store              convert the capture of gpgnet-mock --record\n"
+        "query store [options]            count the packets that pass the filters\n"
+        "  --src port                     only from the port\n"
+        "  --dst port                     only to the port\n"
+        "  --type name                    only CON, ANS, DAT, ACK, KPA or GBY\n"
+        "  --from ms                      captured at or after ms\n"
+        "  --to ms                        captured at or before ms\n"
+        "  --pairs                        packets per source and destination\n"
+        "  --resends                      ... and the DAT packets sent again\n"
+        "  --rows n                       print the first n packets as the .csv log\n",
+        prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "build") == 0)
+        return build(argv[2], argv[3]);
+    if (argc < 3 || strcmp(argv[1], "query") != 0)
+        usage(argv[0]);
+    static struct Query q;
+    struct ColFilter f = { .src = -1, .dst = -1, .type = -1, .from = 0, .to = UINT32_MAX };
+    for (int i = 3; i < argc; i++) {
+        if (strcmp("--src", argv[i]) == 0 && i + 1 < argc) {
+            if ((f.src = port_arg(argv[++i])) < 0)
+                usage(argv[0]);
+        } else if (strcmp("--dst", argv[i]) == 0 && i + 1 < argc) {
+            if ((f.dst = port_arg(argv[++i])) < 0)
+                usage(argv[0]);
+        } else if (strcmp("--type", argv[i]) == 0 && i + 1 < argc) {
+            if ((f.type = mp_type(argv[++i])) < 0)
+                usage(argv[0]);
+        } else if (strcmp("--from", argv[i]) == 0 && i + 1 < argc) {
+            f.from = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp("--to", argv[i]) == 0 && i + 1 < argc) {
+            f.to = (u32)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp("--pairs", argv[i]) == 0) {
+            q.mode = QUERY_PAIRS;
+        } else if (strcmp("--resends", argv[i]) == 0) {
+            q.mode = QUERY_RESENDS;
+        } else if (strcmp("--rows", argv[i]) == 0 && i + 1 < argc) {
+            q.mode = QUERY_ROWS;
+            q.limit = strtoull(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    struct ColStore s;
+    if (!store_open(&s, argv[2])) {
+        fprintf(stderr, "%s: not a column store\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    u64 t0 = now_ns();
+    if (q.mode == QUERY_ROWS)
+        printf(CAP_CSV_COLUMNS "\n");
+    if (q.mode != QUERY_ROWS || q.limit)
+        query_scan(&q, &s, &f);
+    query_report(&q);
+    fprintf(stderr, "%llu of %llu rows in %.1f ms\n", (unsigned long long)q.count,
+        (unsigned long long)s.rows, (now_ns() - t0) / 1e6);
+    return 0;
+}
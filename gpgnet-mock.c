@@ -1,5 +1,10 @@
 #include "mongoose.h"
+#include "tsc.h"
+#include "facap.h"
+#include "mpmsg.h"
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -61,34 +66,118 @@ struct MPMsg {
     u8  data[0];
 } __attribute__((packed));
 
-struct MPRecentList {
-    size_t pos;
-    struct MPHeader items[100];
+#define MP_HISTORY 1024     // packets remembered per link, power of two
+#define MP_CHAIN_HOPS 10    // irt links followed to find the MP_DAT a packet answers
+
+// a packet in the link history, the slot is `ser` modulo MP_HISTORY
+struct MPSent {
+    u16 ser;
+    u16 irt;
+    u8 type;
+    u8 valid;
+};
+
+#define MSG_TICK 0x32         // u8 flag, u32 simtick: the sim of the sender got there
+#define MSG_TICK_ACK1 0x33    // u32 simtick: the sender has the tick, our reading of the captures
+#define MSG_TICK_ACK2 0x34
+#define TICK_RING 256         // ticks of a link waiting for the ack, power of two
+#define TICK_BUCKETS 16       // log2, ticks behind or ms to ack
+
+struct TickSent {
+    u32 tick;
+    uint64_t ns;
+};
+
+// the sim ticks one game reports to another, the time to the MSG_TICK_ACK
+// of the other side is sampled for every tick
+struct TickLink {
+    u32 acked;              // the last tick acked back
+    struct TickSent sent[TICK_RING];
+};
+
+// --tick-lag, the sim of a player compared with the rest of the game
+struct PlayerTicks {
+    bool known;
+    u32 tick;                       // the last MSG_TICK of the player
+    u32 max_behind;
+    uint64_t behind[TICK_BUCKETS];  // ticks behind the most advanced player, at each MSG_TICK
+    uint64_t ack_ms[TICK_BUCKETS];  // from a tick of a peer to its ack by the player
 };
 
+// What the adapter knows about the packets one game sends to another.
+// With --early-ack the adapter of the sender acks an MP_DAT once the relay
+// leg has delivered it, the real MP_ACK of the peer is dropped when it comes.
+struct MPLink {
+    bool known;             // a packet went this way
+    bool acking;            // early ACK started, `acked` is valid
+    bool paused;            // the peer is behind `acked`, its own MP_ACK goes through
+    u32 mask;
+    u16 ser;                // the last serial
+    u16 seq;                // the next MP_DAT sequence number of the sender
+    u16 expected;           // the next MP_DAT sequence number the sender expects
+    u16 acked;              // MP_DAT below that are acked by the adapter
+    u16 acked_old;          // `acked` EARLY_ACK_GRACE to twice that ago
+    u16 acked_new;          // ... up to EARLY_ACK_GRACE ago
+    uint64_t acked_ms;      // when acked_new was taken
+    struct MPSent history[MP_HISTORY];
+    // counters
+    u32 dat;
+    u32 resends;            // MP_DAT sent again by the game
+    u32 early_acks;
+    u32 gaps;               // MP_DAT out of order, not acked early
+    u32 suppressed;         // real MP_ACK dropped
+    u32 pauses;             // early ACK paused, the peer fell behind
+    struct MPStream stream; // --decode, the MPMsg of the MP_DAT payloads
+    struct TickLink ticks;  // --tick-lag
+};
+
+#define MAX_PLAYERS 16
+#define EARLY_ACK_GRACE 50      // ms, the game takes to read what the leg delivered
+
 struct PlayerInfo {
     u32 conbits;
     u32 id;
     u32 lobby_port;
     u32 proxy_port;
-    u16 next_ser;
-    const char *name;
+    char name[16];
     enum GameState game_state;
     struct mg_connection *proxy;
     struct mg_connection *con;
-    struct MPRecentList inbox;
 };
 
-static int s_fake_ack = 0;
+// a datagram on the relay leg, --link-delay
+struct LegPacket {
+    struct LegPacket *next;
+    uint64_t due;           // ms
+    struct mg_connection *c;
+    struct mg_addr rem;
+    size_t len;
+    u8 data[0];
+};
+
+static int s_early_ack = 0;
+static int s_decode = 0;
+static int s_tick_lag = 0;
+static uint64_t s_decode_ns;    // spent in the decoder
+static int s_bench_decode = 0;
+static int s_link_delay = 0;    // ms, one way
+static int s_stats_interval = 0;
+static int s_bench = 0;
+static int s_bench_record = 0;
 static const char *s_port = "7237";
-static FILE *s_log;
+static const char *s_record;
+static struct CapWriter s_capture;  // --record, owned by the capture thread
+static struct CapQueue s_capture_queue;
+static pthread_t s_capture_thread;
+static atomic_int s_capture_stop;
 
 #define HOST_ID 1
-static struct PlayerInfo s_players[] = {
-    { .id = 1, .lobby_port = 6001, .proxy_port = 7001, .name = "player1" },
-    { .id = 2, .lobby_port = 6002, .proxy_port = 7002, .name = "player2" },
-    { .id = 3, .lobby_port = 6003, .proxy_port = 7003, .name = "player3" }
-};
+static struct PlayerInfo s_players[MAX_PLAYERS];
+static int s_num_players = 3;
+static struct MPLink s_links[MAX_PLAYERS][MAX_PLAYERS];    // [from][to] player index
+static struct PlayerTicks s_ticks[MAX_PLAYERS];
+static struct LegPacket *s_leg_head;
+static struct LegPacket **s_leg_tail = &s_leg_head;
 
 static int s_signo;
 
@@ -142,64 +231,202 @@ send_tagged_u32(struct mg_connection *c, u32 u)
     send_u32(c, u);
 }
 
+// player index by the lobby (6001...) or proxy (7001...) port, -1 - unknown
+static int
+player_index(u16 port, u32 base)
+{
+    return port > base && port <= base + (u32)s_num_players ? (int)(port - base - 1) : -1;
+}
+
+static bool
+serial_after(u16 a, u16 b)
+{
+    return (int16_t)(a - b) > 0;
+}
+
+// a packet from the game `from` to the game `to`
+static void
+link_update(struct MPLink *link, struct MPHeader *h)
+{
+    if (h->type == MP_DAT) {
+        link->dat++;
+        if (link->known && !serial_after(h->seq + 1, link->seq))
+            link->resends++;
+        else
+            link->seq = h->seq + 1;
+    } else {
+        link->seq = h->seq;
+    }
+    link->history[h->ser & (MP_HISTORY - 1)] = (struct MPSent){
+        .ser = h->ser, .irt = h->irt, .type = h->type, .valid = 1 };
+    if (!link->known || serial_after(h->ser, link->ser))
+        link->ser = h->ser;
+    link->mask = h->mask;
+    link->expected = h->expected;
+    link->known = true;
+}
+
+static struct MPSent *
+history_find(struct MPLink *link, u16 ser)
+{
+    struct MPSent *e = &link->history[ser & (MP_HISTORY - 1)];
+    return e->valid && e->ser == ser ? e : NULL;
+}
+
+// The MP_DAT that a packet with irt=`ser` answers, `link` carries the packet
+// with that serial, `back` the packets in reply to it. A reply to a reply
+// takes one lookup per hop.
+static struct MPSent *
+history_find_dat(struct MPLink *link, struct MPLink *back, u16 ser)
+{
+    for (int hop = 0; hop < MP_CHAIN_HOPS; ++hop) {
+        struct MPSent *e = history_find(link, ser);
+        if (!e || e->type == MP_DAT)
+            return e;
+        if (!e->irt)
+            return NULL;
+        ser = e->irt;
+        struct MPLink *t = link;
+        link = back;
+        back = t;
+    }
+    return NULL;
+}
+
+// The relay leg delivered the MP_DAT of `from` to the game `to`, answer it
+// for `to` with the serial and the sequence numbers of the last packet `to`
+// sent back. The ACK goes to the game address `game` from the proxy port of
+// `to`, where `from` expects its peer. Only in order data is acked, a gap
+// waits for the real MP_ACK.
 static void
-log_packet(u16 from, u16 to, struct MPHeader *h)
+early_ack(int from, int to, struct MPHeader *h, const struct mg_addr *game)
 {
-    if (!s_log)
+    struct MPLink *link = &s_links[from][to], *back = &s_links[to][from];
+    struct mg_connection *c = s_players[to].proxy;
+    if (!back->known || !c)
         return;
-    const char *mp_name =
-        h->type == MP_CON ? "CON" :
-        h->type == MP_ANS ? "ANS" :
-        h->type == MP_DAT ? "DAT" :
-        h->type == MP_ACK ? "ACK" :
-        h->type == MP_KPA ? "KPA" :
-        h->type == MP_GBY ? "GBY" : "UNK";
-    static char hex[128000];
-    memset(hex, 0, sizeof(hex));
-    MG_DEBUG(("%s: %u len\n", mp_name, h->len));
-    for (size_t i = 0, n = 0; i<h->len; ++i) {
-        n += mg_snprintf(hex + n, sizeof(hex) - n, "%02X", h->data[i]);
-    }
-    static uint64_t s_start_time = 0;
-    if (!s_start_time)
-        s_start_time = mg_millis();
-    fprintf(s_log, "%u\t%u\t%u\t%s\t%u\t%u\t%u\t%u\t%u\tx'%s'\n",
-        (u32)(mg_millis() - s_start_time), from, to, mp_name, h->mask, h->ser, h->irt, h->seq, h->expected, hex);
-    const u8 *ptr = h->data;
-    const u8 *end = h->data + h->len;
-    bool enable_comments = false;
-    while (enable_comments && ptr < end) {
-        struct MPMsg *msg = (struct MPMsg *)ptr;
-        ptr += msg->len;
-        if (msg->len == 0 || ptr > end) {
-            MG_ERROR(("MPMsg parse error, len=%u ptr=%p end=%p", msg->len, ptr, end));
-            break;
-        }
-        if (msg->type == 0x32) {
-            fprintf(s_log, " -- %#02x %u %u\n", msg->type, msg->data[0], *(u32*)(msg->data + 1));
-        } else if (msg->type == 0x33) {
-            fprintf(s_log, " -- %#02x   %u\n", msg->type, *(u32*)msg->data);
-        } else if (msg->type == 0x34) {
-            fprintf(s_log, " -- %#02x   %u\n", msg->type, *(u32*)msg->data);
-        } else if (msg->type == 0x00) {
-            fprintf(s_log, " -- %#02x   %u\n", msg->type, *(u32*)msg->data);
-        } else {
-            // unknown message
-            fprintf(s_log, " -- %#02x   %u bytes", msg->type, msg->len - 1);
+    if (!link->acking) {
+        // the adapter has seen every MP_DAT of the link, the first one is the oldest unacked
+        link->acked = link->acked_old = link->acked_new = h->seq;
+        link->acked_ms = loop_ms();
+        link->acking = true;
+    }
+    if (h->seq == link->acked) {
+        link->acked++;
+    } else if (serial_after(h->seq, link->acked)) {
+        link->gaps++;
+        return;
+    }
+    if (link->paused)
+        return;
+    // a resend of acked data is acked again, the game has missed the first MP_ACK
+    struct MPHeader ack = {
+        .type = MP_ACK,
+        .mask = back->mask,
+        .ser = back->ser,
+        .irt = h->ser,
+        .seq = back->seq,
+        .expected = link->acked,
+    };
+    struct mg_addr rem = c->rem;
+    c->rem = *game;
+    mg_send(c, &ack, sizeof(ack));
+    c->rem = rem;
+    link->early_acks++;
+}
+
+// A packet of `to` leaves the game, its `expected` is what `to` really has of
+// the data of `from`. While that is behind what the adapter acked
+// EARLY_ACK_GRACE ms ago or earlier, the game has lost data the sender takes
+// as delivered: the early ACK pauses and the real MP_ACK of `to` goes through
+// until the game catches up.
+static void
+early_ack_check(int from, int to, struct MPHeader *h)
+{
+    struct MPLink *link = &s_links[from][to];
+    if (!link->acking)
+        return;
+    uint64_t now = loop_ms();
+    if (now - link->acked_ms >= EARLY_ACK_GRACE) {
+        link->acked_old = link->acked_new;
+        link->acked_new = link->acked;
+        link->acked_ms = now;
+    }
+    bool behind = serial_after(link->acked_old, h->expected);
+    if (behind && !link->paused)
+        link->pauses++;
+    link->paused = behind;
+}
+
+// A packet of `from` is about to reach `to`, the adapter of `to` has acked
+// its data already. Returns false if the packet tells nothing new.
+static bool
+early_ack_filter(int from, int to, struct MPHeader *h)
+{
+    struct MPLink *link = &s_links[to][from];
+    if (!link->acking || link->paused || serial_after(h->expected, link->acked))
+        return true;
+    // an MP_ACK of anything but data, e.g. MP_KPA, goes through
+    if (h->type == MP_ACK && history_find_dat(link, &s_links[from][to], h->irt)) {
+        link->suppressed++;
+        return false;
+    }
+    return true;
+}
+
+static bool
+leg_send(struct mg_connection *c, void *buf, size_t len)
+{
+    if (!s_link_delay)
+        return mg_send(c, buf, len);
+    struct LegPacket *p = (struct LegPacket *)malloc(sizeof(*p) + len);
+    if (!p)
+        return false;
+    p->next = NULL;
+    p->due = loop_ms() + (uint64_t)s_link_delay;
+    p->c = c;
+    p->rem = c->rem;
+    p->len = len;
+    memcpy(p->data, buf, len);
+    *s_leg_tail = p;
+    s_leg_tail = &p->next;
+    return true;
+}
+
+static void
+leg_flush(bool all)
+{
+    uint64_t now = loop_ms();
+    while (s_leg_head && (all || s_leg_head->due <= now)) {
+        struct LegPacket *p = s_leg_head;
+        if ((s_leg_head = p->next) == NULL)
+            s_leg_tail = &s_leg_head;
+        if (p->c && !all) {
+            p->c->rem = p->rem;
+            mg_send(p->c, p->data, p->len);
         }
+        free(p);
     }
 }
 
 static void
-recent_add(struct MPRecentList *list, struct MPHeader *h)
+leg_forget(struct mg_connection *c)
 {
-    size_t i = (list->pos + 1) % count_of(list->items);
-    list->items[i] = *h;
-    list->pos = i;
+    for (struct LegPacket *p = s_leg_head; p; p = p->next) {
+        if (p->c == c)
+            p->c = NULL;
+    }
 }
 
+// --bench, the 100 entry inbox scanned from the start for every hop, the
+// way the first --fake-ack looked up the MP_DAT an MP_ACK answers
+struct LinearInbox {
+    size_t pos;
+    struct MPHeader items[100];
+};
+
 static struct MPHeader *
-recent_lookup_dat(struct MPRecentList *list, u16 ser)
+linear_lookup_dat(struct LinearInbox *list, u16 ser)
 {
     for (size_t i = 0, limit = 0; i < count_of(list->items) && limit < 10; ++i) {
         struct MPHeader *h = &list->items[i];
@@ -216,6 +443,415 @@ recent_lookup_dat(struct MPRecentList *list, u16 ser)
     return NULL;
 }
 
+// The cost of the adapter bookkeeping per packet, no sockets: player1 sends
+// n MP_DAT and MP_KPA (every 4th), player2 acks each, the adapter records
+// both and looks up what every MP_ACK answers.
+static void
+bench_history(int n)
+{
+    static struct LinearInbox inbox;
+    struct MPLink *out = &s_links[0][1], *back = &s_links[1][0];
+    uint64_t found = 0, linear_found = 0;
+    uint64_t t0 = tsc_ns();
+    for (int i = 0; i < n; ++i) {
+        struct MPHeader h = { .type = i % 4 ? MP_DAT : MP_KPA, .ser = (u16)(2 * i + 1), .seq = (u16)i };
+        struct MPHeader ack = { .type = MP_ACK, .ser = (u16)(2 * i + 2), .irt = h.ser, .seq = (u16)i };
+        link_update(out, &h);
+        link_update(back, &ack);
+        found += history_find_dat(out, back, ack.irt) != NULL;
+    }
+    uint64_t t1 = tsc_ns();
+    for (int i = 0; i < n; ++i) {
+        struct MPHeader h = { .type = i % 4 ? MP_DAT : MP_KPA, .ser = (u16)(2 * i + 1), .seq = (u16)i };
+        inbox.pos = (inbox.pos + 1) % count_of(inbox.items);
+        inbox.items[inbox.pos] = h;
+        linear_found += linear_lookup_dat(&inbox, h.ser) != NULL;
+    }
+    uint64_t t2 = tsc_ns();
+    printf("packets=%d history=%d: %.1f ns/packet, found=%llu\n", 2 * n, MP_HISTORY,
+        (double)(t1 - t0) / (2.0 * n), (unsigned long long)found);
+    printf("linear inbox=%zu: %.1f ns/packet, found=%llu\n", count_of(inbox.items),
+        (double)(t2 - t1) / (2.0 * n), (unsigned long long)linear_found);
+    memset(s_links, 0, sizeof(s_links));
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+sleep_ms(int ms)
+{
+#if defined(_WIN32)
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+// writes the queued packets in the background, the packet loop never waits for disk
+static void *
+capture_thread(void *arg)
+{
+    (void)arg;
+    while (!atomic_load_explicit(&s_capture_stop, memory_order_acquire)) {
+        if (!cap_queue_drain(&s_capture_queue, &s_capture))
+            sleep_ms(1);
+    }
+    cap_queue_drain(&s_capture_queue, &s_capture);
+    return NULL;
+}
+
+static bool
+capture_start(const char *filename)
+{
+    if (!cap_open(&s_capture, filename, tsc_ns())) {
+        perror(filename);
+        return false;
+    }
+    if (!cap_queue_init(&s_capture_queue)) {
+        MG_ERROR(("OOM"));
+        return false;
+    }
+    atomic_store(&s_capture_stop, 0);
+    if (pthread_create(&s_capture_thread, NULL, capture_thread, NULL) != 0) {
+        MG_ERROR(("pthread_create failed"));
+        return false;
+    }
+    return true;
+}
+
+static void
+capture_stop(void)
+{
+    if (!s_capture_queue.buf)
+        return;
+    atomic_store_explicit(&s_capture_stop, 1, memory_order_release);
+    pthread_join(s_capture_thread, NULL);
+    cap_close(&s_capture);
+    cap_queue_free(&s_capture_queue);
+}
+
+static void
+print_capture(void)
+{
+    struct CapQueue *q = &s_capture_queue;
+    MG_INFO(("capture packets=%llu dropped=%llu fill=%lluKB max_fill=%lluKB of %dKB",
+        (unsigned long long)q->pushed, (unsigned long long)atomic_load(&q->dropped),
+        (unsigned long long)cap_queue_fill(q) / 1024,
+        (unsigned long long)atomic_load(&q->max_fill) / 1024, CAP_QUEUE_SIZE / 1024));
+}
+
+// --bench-record, n packets of 100 bytes of payload between 4 players in
+// bursts of 100 a millisecond, written by the packet loop as before and then
+// through the capture queue, every call is timed, a forwarded packet waits for it
+static void
+bench_record(int n, const char *filename)
+{
+    u8 buf[sizeof(struct MPHeader) + 100];
+    struct MPHeader *h = (struct MPHeader *)buf;
+    for (size_t i = 0; i < sizeof(buf); ++i)
+        buf[i] = (u8)(i * 7);
+    h->type = MP_DAT;
+    h->len = 100;
+    uint64_t *calls = (uint64_t *)malloc((size_t)n * sizeof(*calls));
+    if (!calls) {
+        MG_ERROR(("OOM"));
+        return;
+    }
+    for (int queued = 0; queued < 2; ++queued) {
+        if (queued ? !capture_start(filename) : !cap_open(&s_capture, filename, tsc_ns()))
+            break;
+        uint64_t sum = 0;
+        uint64_t t0 = tsc_ns();
+        for (int i = 0; i < n; ++i) {
+            h->ser = (u16)i;
+            h->seq = (u16)i;
+            u16 src = (u16)(6001 + i % 4), dst = (u16)(6001 + (i + 1) % 4);
+            uint64_t start = tsc_ns();
+            if (queued)
+                cap_queue_push(&s_capture_queue, start, src, dst, buf, sizeof(buf));
+            else
+                cap_packet(&s_capture, start, src, dst, buf, sizeof(buf));
+            sum += calls[i] = tsc_ns() - start;
+            if (i % 100 == 99)
+                sleep_ms(1);
+        }
+        unsigned long long dropped = queued ? atomic_load(&s_capture_queue.dropped) : 0;
+        if (queued)
+            capture_stop();
+        else
+            cap_close(&s_capture);
+        uint64_t t1 = tsc_ns();
+        qsort(calls, (size_t)n, sizeof(*calls), cmp_u64);
+        size_t size = 0;
+        FILE *fp = fopen(filename, "rb");
+        if (fp) {
+            fseek(fp, 0, SEEK_END);
+            size = (size_t)ftell(fp);
+            fclose(fp);
+        }
+        printf("%s packets=%d: call ns avg=%.0f p50=%llu p99=%llu p99.9=%llu max=%llu dropped=%llu\n",
+            queued ? "queued" : "direct", n, (double)sum / n, (unsigned long long)calls[n / 2],
+            (unsigned long long)calls[(size_t)(n * 0.99)], (unsigned long long)calls[(size_t)(n * 0.999)],
+            (unsigned long long)calls[n - 1], dropped);
+        printf("  %.0f packets/s, %.1f bytes/packet\n", n / ((t1 - t0) / 1e9), (double)size / n);
+    }
+    free(calls);
+}
+
+static int
+tick_bucket(uint64_t v)
+{
+    int i = 0;
+    for (; v > 0 && i < TICK_BUCKETS - 1; v >>= 1)
+        i++;
+    return i;
+}
+
+// upper bound of the bucket that holds the p-th sample, the bucket i holds
+// [2^(i-1), 2^i), 0 - no samples
+static uint64_t
+tick_percentile(const uint64_t *hist, double p)
+{
+    uint64_t n = 0, seen = 0;
+    for (int i = 0; i < TICK_BUCKETS; ++i)
+        n += hist[i];
+    uint64_t rank = (uint64_t)(p * (double)n);
+    for (int i = 0; n && i < TICK_BUCKETS; ++i) {
+        seen += hist[i];
+        if (seen > rank)
+            return 1ULL << i;
+    }
+    return 0;
+}
+
+// player `from` reports its sim at `tick` to `to`
+static void
+tick_sent(int from, int to, u32 tick, uint64_t now)
+{
+    struct PlayerTicks *p = &s_ticks[from];
+    struct TickSent *slot = &s_links[from][to].ticks.sent[tick & (TICK_RING - 1)];
+    if (slot->tick != tick || !slot->ns)
+        *slot = (struct TickSent){ tick, now };
+    if (p->known && tick <= p->tick)
+        return;
+    p->known = true;
+    p->tick = tick;
+    u32 top = tick;
+    for (int i = 0; i < s_num_players; ++i) {
+        if (s_ticks[i].known && s_ticks[i].tick > top)
+            top = s_ticks[i].tick;
+    }
+    // every player falls behind by the ticks the others made since its last report
+    for (int i = 0; i < s_num_players; ++i) {
+        struct PlayerTicks *q = &s_ticks[i];
+        if (!q->known || (i != from && top != tick))
+            continue;
+        u32 behind = top - q->tick;
+        q->behind[tick_bucket(behind)]++;
+        if (behind > q->max_behind)
+            q->max_behind = behind;
+    }
+}
+
+// player `from` acks the ticks of `to` up to `tick`
+static void
+tick_acked(int from, int to, u32 tick, uint64_t now)
+{
+    struct TickLink *l = &s_links[to][from].ticks;
+    if (tick <= l->acked)
+        return;
+    u32 first = tick - l->acked > TICK_RING ? tick - TICK_RING + 1 : l->acked + 1;
+    for (u32 t = first; t <= tick; ++t) {
+        struct TickSent *slot = &l->sent[t & (TICK_RING - 1)];
+        if (slot->tick == t && slot->ns && now >= slot->ns)
+            s_ticks[from].ack_ms[tick_bucket((now - slot->ns) / 1000000)]++;
+        slot->ns = 0;
+    }
+    l->acked = tick;
+}
+
+static u32
+msg_u32(const u8 *p)
+{
+    return (u32)p[0] | (u32)p[1] << 8 | (u32)p[2] << 16 | (u32)p[3] << 24;
+}
+
+// `arg` is the link in s_links, from and to are its indexes
+static void
+on_message(void *arg, u8 type, const u8 *data, size_t len)
+{
+    size_t link = (size_t)((struct MPLink *)arg - &s_links[0][0]);
+    int from = (int)(link / MAX_PLAYERS), to = (int)(link % MAX_PLAYERS);
+    MG_DEBUG(("%s->%s msg %#02x len=%u", s_players[from].name, s_players[to].name, type, (unsigned)len));
+    if (!s_tick_lag)
+        return;
+    if (type == MSG_TICK && len >= 5)
+        tick_sent(from, to, msg_u32(data + 1), tsc_ns());
+    else if ((type == MSG_TICK_ACK1 || type == MSG_TICK_ACK2) && len >= 4)
+        tick_acked(from, to, msg_u32(data), tsc_ns());
+}
+
+static void
+print_ticks(void)
+{
+    int worst = -1;
+    u32 top = 0;
+    for (int i = 0; i < s_num_players; ++i) {
+        if (s_ticks[i].known && s_ticks[i].tick > top)
+            top = s_ticks[i].tick;
+    }
+    for (int i = 0; i < s_num_players; ++i) {
+        struct PlayerTicks *p = &s_ticks[i];
+        if (!p->known)
+            continue;
+        char hist[TICK_BUCKETS * 24] = "";
+        size_t n = 0;
+        for (int k = 0; k < TICK_BUCKETS; ++k) {
+            if (p->behind[k])
+                n += mg_snprintf(hist + n, sizeof(hist) - n, " <%llu:%llu",
+                    1ULL << k, (unsigned long long)p->behind[k]);
+        }
+        MG_INFO(("%s tick=%u behind=%u ticks, p50<%llu p99<%llu max=%u, acks peers ms p50<%llu p99<%llu",
+            s_players[i].name, p->tick, top - p->tick,
+            (unsigned long long)tick_percentile(p->behind, 0.5), (unsigned long long)tick_percentile(p->behind, 0.99),
+            p->max_behind, (unsigned long long)tick_percentile(p->ack_ms, 0.5),
+            (unsigned long long)tick_percentile(p->ack_ms, 0.99)));
+        MG_INFO(("%s behind histogram ticks:%s", s_players[i].name, hist));
+        n = 0;
+        hist[0] = 0;
+        for (int k = 0; k < TICK_BUCKETS; ++k) {
+            if (p->ack_ms[k])
+                n += mg_snprintf(hist + n, sizeof(hist) - n, " <%llu:%llu",
+                    1ULL << k, (unsigned long long)p->ack_ms[k]);
+        }
+        MG_INFO(("%s ack histogram ms:%s", s_players[i].name, hist));
+        // the furthest behind now, the slower acks break a tie
+        if (worst < 0 || p->tick < s_ticks[worst].tick ||
+            (p->tick == s_ticks[worst].tick &&
+                tick_percentile(p->ack_ms, 0.99) > tick_percentile(s_ticks[worst].ack_ms, 0.99)))
+            worst = i;
+    }
+    if (worst >= 0 && s_ticks[worst].tick == top)
+        MG_INFO(("all players at tick %u", top));
+    else if (worst >= 0)
+        MG_INFO(("the game waits for %s: %u ticks behind, acks p99<%llums", s_players[worst].name,
+            top - s_ticks[worst].tick, (unsigned long long)tick_percentile(s_ticks[worst].ack_ms, 0.99)));
+}
+
+// --decode, the payload of an MP_DAT as the game sent it
+static void
+decode_packet(struct MPLink *link, struct MPHeader *h, size_t len)
+{
+    size_t n = len - sizeof(*h) < h->len ? len - sizeof(*h) : h->len;
+    uint64_t start = tsc_ns();
+    bool was_broken = link->stream.broken;
+    if (!mps_packet(&link->stream, h->seq, h->data, n, on_message, link) && !was_broken)
+        MG_ERROR(("link %p: MP_DAT seq=%u doesn't decode, the stream is out of sync", link, h->seq));
+    s_decode_ns += tsc_ns() - start;
+}
+
+// a deflate stream of n MP_DAT with the idle sim messages of a tick and a
+// 64 byte command each
+static u8 *
+bench_stream(int n, u16 *lens)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    u8 *out = (u8 *)malloc((size_t)n * 256);
+    if (!out || deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MPS_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    for (int i = 0; i < n; ++i) {
+        u8 msgs[128], *p = msgs;
+        u32 tick = (u32)i;
+        *p++ = 0x32; *p++ = 8; *p++ = 0; *p++ = 0; memcpy(p, &tick, 4); p += 4;
+        *p++ = 0x00; *p++ = 7; *p++ = 0; memcpy(p, "\1\0\0\0", 4); p += 4;
+        *p++ = 0x34; *p++ = 7; *p++ = 0; memcpy(p, &tick, 4); p += 4;
+        *p++ = 0x33; *p++ = 7; *p++ = 0; memcpy(p, &tick, 4); p += 4;
+        *p++ = 0x16; *p++ = 67; *p++ = 0;
+        for (int k = 0; k < 64; ++k)
+            *p++ = (u8)(i * 31 + k * (k & 3));
+        z.next_in = msgs;
+        z.avail_in = (uInt)(p - msgs);
+        z.next_out = out + (size_t)i * 256;
+        z.avail_out = 256;
+        deflate(&z, Z_SYNC_FLUSH);
+        lens[i] = (u16)(256 - z.avail_out);
+    }
+    deflateEnd(&z);
+    return out;
+}
+
+static void
+count_message(void *arg, u8 type, const u8 *data, size_t len)
+{
+    (*(uint64_t *)arg)++;
+    (void)type;
+    (void)data;
+    (void)len;
+}
+
+// --bench-decode, the decoder at full speed: every 10th MP_DAT comes after
+// the next one, every 20th twice
+static void
+bench_decode(int n)
+{
+    u16 *lens = (u16 *)malloc((size_t)n * sizeof(*lens));
+    u8 *stream = lens ? bench_stream(n, lens) : NULL;
+    if (!stream) {
+        MG_ERROR(("OOM"));
+        return;
+    }
+    struct MPStream s;
+    memset(&s, 0, sizeof(s));
+    uint64_t messages = 0, bytes = 0;
+    uint64_t t0 = tsc_ns();
+    for (int i = 0; i < n; ++i) {
+        int k = i % 10 == 1 && i + 1 < n ? i + 1 : i % 10 == 2 ? i - 1 : i;
+        mps_packet(&s, (u16)(k + 1), stream + (size_t)k * 256, lens[k], count_message, &messages);
+        if (i % 20 == 19)
+            mps_packet(&s, (u16)(k + 1), stream + (size_t)k * 256, lens[k], count_message, &messages);
+        bytes += lens[k];
+    }
+    uint64_t t1 = tsc_ns();
+    printf("packets=%llu: %.0f ns/packet, %.1f MB/s in, %.1f MB/s out, messages=%llu resends=%llu reordered=%llu%s\n",
+        (unsigned long long)s.packets, (double)(t1 - t0) / (double)s.packets, bytes / ((t1 - t0) / 1e3),
+        s.bytes_out / ((t1 - t0) / 1e3), (unsigned long long)messages, (unsigned long long)s.resends,
+        (unsigned long long)s.reordered, s.broken ? " BROKEN" : "");
+    mps_free(&s);
+    free(stream);
+    free(lens);
+}
+
+static void
+print_links(void)
+{
+    for (int i = 0; i < s_num_players; ++i) {
+        for (int k = 0; k < s_num_players; ++k) {
+            struct MPLink *l = &s_links[i][k];
+            if (!l->dat)
+                continue;
+            MG_INFO(("%s->%s dat=%u resends=%u early_acks=%u gaps=%u suppressed=%u pauses=%u",
+                s_players[i].name, s_players[k].name, l->dat, l->resends, l->early_acks, l->gaps,
+                l->suppressed, l->pauses));
+            if (s_decode)
+                MG_INFO(("%s->%s messages=%llu inflated=%llu/%llu bytes reordered=%llu%s",
+                    s_players[i].name, s_players[k].name, (unsigned long long)l->stream.messages,
+                    (unsigned long long)l->stream.bytes_in, (unsigned long long)l->stream.bytes_out,
+                    (unsigned long long)l->stream.reordered, l->stream.broken ? " broken" : ""));
+        }
+    }
+    if (s_decode)
+        MG_INFO(("decoder %llu us", (unsigned long long)(s_decode_ns / 1000)));
+}
+
 static void
 proxy_fn(struct mg_connection *c, int ev, void *ev_data)
 {
@@ -223,37 +859,44 @@ proxy_fn(struct mg_connection *c, int ev, void *ev_data)
     if (ev == MG_EV_OPEN) {
         //c->is_hexdumping = 1;
         MG_DEBUG(("%s proxy is ready", player->name));
+    } else if (ev == MG_EV_CLOSE) {
+        leg_forget(c);
     }
     if (ev != MG_EV_READ)
         return;
     u16 rem_port = mg_ntohs(c->rem.port);
     struct MPHeader *h = (struct MPHeader *)c->recv.buf;
+    int self = (int)(player - s_players);
+    if (c->recv.len < sizeof(*h)) {
+        c->recv.len = 0;
+        return;
+    }
     if (rem_port < 7000) {
-        if (h->ser > player->next_ser)
-            player->next_ser = h->ser;
-        // packet from the game
-        log_packet(rem_port, player->lobby_port, h);
-        struct MPHeader *irt_dat = recent_lookup_dat(&player->inbox, h->irt);
-        if (s_fake_ack && h->type == MP_ACK && irt_dat)
-            return; // skip ACK only for DAT packets
-        if (s_fake_ack && h->type == MP_DAT && irt_dat) {
-            struct MPHeader ack = {
-                .type = MP_ACK,
-                .irt = h->ser,
-                .ser = player->next_ser,
-                .seq = h->expected,
-                .expected = h->seq + 1,
-            };
-            mg_send(c, &ack, sizeof(ack));
-        }
-        rem_port += 1000;
+        // packet from the game of another player to this one, goes over the relay leg
+        int from = player_index(rem_port, 6000);
+        if (s_capture_queue.buf)
+            cap_queue_push(&s_capture_queue, tsc_ns(), rem_port, (u16)player->lobby_port, c->recv.buf, c->recv.len);
+        if (from >= 0)
+            link_update(&s_links[from][self], h);
+        if (s_early_ack && from >= 0)
+            early_ack_check(self, from, h);
+        if (s_decode && from >= 0 && h->type == MP_DAT)
+            decode_packet(&s_links[from][self], h, c->recv.len);
+        c->rem.port = mg_htons(rem_port + 1000);
+        leg_send(c, c->recv.buf, c->recv.len);
     } else {
-        // packet from the proxy
-        rem_port -= 1000;
-        recent_add(&player->inbox, h);
+        // packet of this player from the relay leg, deliver it to the game
+        int dest = player_index(rem_port, 7000);
+        c->rem.port = mg_htons(rem_port - 1000);
+        if (!s_early_ack || dest < 0 || early_ack_filter(self, dest, h))
+            mg_send(c, c->recv.buf, c->recv.len);
+        if (s_early_ack && dest >= 0 && h->type == MP_DAT) {
+            // the leg delivered it, the adapter of `dest` acks it to this game
+            struct mg_addr game = c->rem;
+            game.port = mg_htons((u16)player->lobby_port);
+            early_ack(self, dest, h, &game);
+        }
     }
-    c->rem.port = mg_htons(rem_port);
-    mg_send(c, c->recv.buf, c->recv.len);
     c->recv.len = 0;
     (void)ev_data;
 }
@@ -294,7 +937,7 @@ handle_command(struct mg_connection *c, struct PlayerInfo *player, struct GPGNet
                 send_u32(c, 1);
                 send_tagged_str(c, mg_str("monument_valley.v0001"));
             } else {
-                struct PlayerInfo *host = &s_players[0];
+                struct PlayerInfo *host = &s_players[HOST_ID - 1];
                 // connect host
                 send_str(host->con, mg_str("ConnectToPeer"));
                 send_u32(host->con, 3);
@@ -333,7 +976,7 @@ gpgnet_fn(struct mg_connection *c, int ev, void *ev_data)
     if (ev == MG_EV_OPEN) {
         //c->is_hexdumping = 1;
     } else if (ev == MG_EV_ACCEPT) {
-        for (size_t i = 0; i < count_of(s_players); ++i) {
+        for (int i = 0; i < s_num_players; ++i) {
             struct PlayerInfo *player = &s_players[i];
             if (!player->con) {
                 player->con = c;
@@ -350,7 +993,7 @@ gpgnet_fn(struct mg_connection *c, int ev, void *ev_data)
             s_signo = SIGTERM;
             MG_INFO(("host is disconnected, closing"));
         }
-        for (size_t i = 0; i < count_of(s_players); ++i) {
+        for (int i = 0; i < s_num_players; ++i) {
             struct PlayerInfo *peer = &s_players[i];
             if (player->id != peer->id && (player->conbits & (1 << peer->id))) {
                 MG_INFO(("disconnect %s from %s", player->name, peer->name));
@@ -369,7 +1012,7 @@ gpgnet_fn(struct mg_connection *c, int ev, void *ev_data)
         if (player->proxy)
             player->proxy->is_closing = 1;
     } else if (ev == MG_EV_POLL && player) {
-        for (size_t i = 1; i < count_of(s_players); ++i) {
+        for (int i = 1; i < s_num_players; ++i) {
             struct PlayerInfo *peer = &s_players[i];
             // connect every player
             if (player->id == peer->id || player->game_state != GAME_STATE_LOBBY || peer->game_state != GAME_STATE_LOBBY)
@@ -446,8 +1089,17 @@ usage(const char *prog)
         "%s usage:\n"
         "--help                           show help message\n"
         "--debug                          enable verbose logging\n"
-        "--record filename                record all message into .csv file\n"
-        "--fake-ack                       send fake MP_ACK for every MP_DAT\n"
+        "--record filename                record all packets into the binary capture, see facap\n"
+        "--bench-record n                 write n packets to the --record file and exit\n"
+        "--decode                         inflate the MP_DAT payloads into MPMsg, see --debug\n"
+        "--bench-decode n                 decode a stream of n MP_DAT and exit\n"
+        "--tick-lag                       --decode and track the sim ticks of the players, see --stats\n"
+        "--early-ack                      ack MP_DAT delivered by the relay leg, drop the real MP_ACK\n"
+        "--fake-ack                       same as --early-ack\n"
+        "--bench n                        time the link history lookup of n packets and exit\n"
+        "--link-delay ms                  one way delay of the relay leg\n"
+        "--players n                      number of game slots, default 3, max 16\n"
+        "--stats sec                      log the early ACK counters every sec seconds\n"
         "--port arg                       set the GPGNet port\n",
         prog);
     exit(EXIT_FAILURE);
@@ -462,34 +1114,96 @@ main(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         if (mg_casecmp("--port", argv[i]) == 0) {
             s_port = argv[++i];
-        } else if (mg_casecmp("--fake-ack", argv[i]) == 0) {
-            s_fake_ack = 1;
+        } else if (mg_casecmp("--early-ack", argv[i]) == 0 || mg_casecmp("--fake-ack", argv[i]) == 0) {
+            s_early_ack = 1;
+        } else if (mg_casecmp("--link-delay", argv[i]) == 0) {
+            s_link_delay = atoi(argv[++i]);
+        } else if (mg_casecmp("--players", argv[i]) == 0) {
+            s_num_players = atoi(argv[++i]);
+        } else if (mg_casecmp("--stats", argv[i]) == 0) {
+            s_stats_interval = atoi(argv[++i]);
+        } else if (mg_casecmp("--bench", argv[i]) == 0) {
+            s_bench = atoi(argv[++i]);
+        } else if (mg_casecmp("--decode", argv[i]) == 0) {
+            s_decode = 1;
+        } else if (mg_casecmp("--tick-lag", argv[i]) == 0) {
+            s_decode = s_tick_lag = 1;
+        } else if (mg_casecmp("--bench-decode", argv[i]) == 0) {
+            s_bench_decode = atoi(argv[++i]);
+        } else if (mg_casecmp("--bench-record", argv[i]) == 0) {
+            s_bench_record = atoi(argv[++i]);
         } else if (mg_casecmp("--debug", argv[i]) == 0) {
             mg_log_set(MG_LL_DEBUG);
         } else if (mg_casecmp("--record", argv[i]) == 0) {
-            const char *filename = argv[++i];
-            s_log = fopen(filename, "w+");
-            if (!s_log) {
-                perror(filename);
-                exit(EXIT_FAILURE);
-            }
-            MG_INFO(("start recording to %s", filename));
-            fprintf(s_log, "ts\tsrc\tdst\ttype\tmask\tser\tirt\tseq\texpected\tdata\n");
+            s_record = argv[++i];
         } else {
             usage(argv[0]);
         }
     }
+    if (s_num_players < 2 || s_num_players > MAX_PLAYERS || s_link_delay < 0)
+        usage(argv[0]);
+    if (s_bench_record > 0 && !s_record)
+        usage(argv[0]);
+    for (int i = 0; i < s_num_players; ++i) {
+        struct PlayerInfo *player = &s_players[i];
+        player->id = (u32)i + 1;
+        player->lobby_port = 6001 + (u32)i;
+        player->proxy_port = 7001 + (u32)i;
+        mg_snprintf(player->name, sizeof(player->name), "player%d", i + 1);
+    }
+    tsc_init();
+    if (s_bench > 0) {
+        bench_history(s_bench);
+        return 0;
+    }
+    if (s_bench_record > 0) {
+        bench_record(s_bench_record, s_record);
+        return 0;
+    }
+    if (s_bench_decode > 0) {
+        bench_decode(s_bench_decode);
+        return 0;
+    }
+    if (s_record) {
+        if (!capture_start(s_record))
+            exit(EXIT_FAILURE);
+        MG_INFO(("start recording to %s", s_record));
+    }
     struct mg_mgr mgr;
     mg_mgr_init(&mgr);
     char url[100];
     mg_snprintf(url, sizeof(url), "tcp://127.0.0.1:%s", s_port);
     mg_listen(&mgr, url, gpgnet_fn, NULL);
+    loop_clock_update();
+    uint64_t next_stats = loop_ms() + (uint64_t)s_stats_interval * 1000;
     while (s_signo == 0) {
-        mg_mgr_poll(&mgr, 25);
+        // the delayed datagrams go out on time, and with --link-delay the
+        // loop clock the packet handlers stamp them with is at most 1ms old
+        mg_mgr_poll(&mgr, s_link_delay ? 1 : 25);
+        loop_clock_update();
+        leg_flush(false);
+        if (s_stats_interval && loop_ms() >= next_stats) {
+            next_stats = loop_ms() + (uint64_t)s_stats_interval * 1000;
+            print_links();
+            if (s_tick_lag)
+                print_ticks();
+            if (s_record)
+                print_capture();
+        }
     }
     MG_INFO(("exit s_signo=%u", s_signo));
+    if (s_early_ack || s_decode || s_stats_interval)
+        print_links();
+    if (s_tick_lag)
+        print_ticks();
+    for (int i = 0; i < MAX_PLAYERS; ++i) {
+        for (int k = 0; k < MAX_PLAYERS; ++k)
+            mps_free(&s_links[i][k].stream);
+    }
+    leg_flush(true);
     mg_mgr_free(&mgr);
-    if (s_log)
-        fclose(s_log);
+    if (s_record)
+        print_capture();
+    capture_stop();
     return 0;
 }
@@ -0,0 +1,214 @@
+// Hex encoding of the packet data, the x'...' column of the .csv log.
+//
+//   hex_encode(dst, src, n)   2n upper case digits, no terminator
+//   hex_decode(dst, src, n)   n bytes from 2n digits of any case, false - not a digit
+//
+// The AVX2 or SSE2 version is picked by the CPU on the first call, the
+// scalar one is the fallback and handles the tails.
+#ifndef HEX_H
+#define HEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static const char s_hex_digits[] = "0123456789ABCDEF";
+
+static inline void
+hex_encode_scalar(char *dst, const uint8_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dst[2 * i] = s_hex_digits[src[i] >> 4];
+        dst[2 * i + 1] = s_hex_digits[src[i] & 15];
+    }
+}
+
+// 0-15, or 0xff for a non digit
+static inline uint8_t
+hex_value(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return (uint8_t)(c - '0');
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return (uint8_t)(c - 'a' + 10);
+    return 0xff;
+}
+
+static inline bool
+hex_decode_scalar(uint8_t *dst, const char *src, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t hi = hex_value((uint8_t)src[2 * i]), lo = hex_value((uint8_t)src[2 * i + 1]);
+        if ((hi | lo) & 0xf0)
+            return false;
+        dst[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
+
+#if defined(__x86_64__)
+// nibbles to digits: n + '0', plus 7 more for A-F
+static inline __m128i
+hex_digits_sse2(__m128i n)
+{
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letter);
+}
+
+static inline void
+hex_encode_sse2(char *dst, const uint8_t *src, size_t n)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i hi = hex_digits_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = hex_digits_sse2(_mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    hex_encode_scalar(dst + 2 * i, src + i, n - i);
+}
+
+// 16 digits to their values, `bad` collects the non digits
+static inline __m128i
+hex_values_sse2(__m128i c, __m128i *bad)
+{
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), lower));
+    *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(digit, letter), _mm_set1_epi8(-1)));
+    __m128i d = _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+    __m128i l = _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+    return _mm_or_si128(d, l);
+}
+
+// byte pairs (high nibble, low nibble) to a byte in the low half of each word
+static inline __m128i
+hex_pack_sse2(__m128i v)
+{
+    return _mm_and_si128(_mm_or_si128(_mm_slli_epi16(v, 4), _mm_srli_epi16(v, 8)), _mm_set1_epi16(0xff));
+}
+
+static inline bool
+hex_decode_sse2(uint8_t *dst, const char *src, size_t n)
+{
+    __m128i bad = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = hex_values_sse2(_mm_loadu_si128((const __m128i *)(src + 2 * i)), &bad);
+        __m128i b = hex_values_sse2(_mm_loadu_si128((const __m128i *)(src + 2 * i + 16)), &bad);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(hex_pack_sse2(a), hex_pack_sse2(b)));
+    }
+    if (_mm_movemask_epi8(bad))
+        return false;
+    return hex_decode_scalar(dst + i, src + 2 * i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hex_digits_avx2(__m256i n)
+{
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)), _mm256_set1_epi8(7));
+    return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), letter);
+}
+
+__attribute__((target("avx2"))) static void
+hex_encode_avx2(char *dst, const uint8_t *src, size_t n)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i hi = hex_digits_avx2(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        __m256i lo = hex_digits_avx2(_mm256_and_si256(v, mask));
+        // the unpacks stay within the 128 bit lanes, the permutes put the halves in order
+        __m256i a = _mm256_unpacklo_epi8(hi, lo), b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    hex_encode_sse2(dst + 2 * i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hex_values_avx2(__m256i c, __m256i *bad)
+{
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    *bad = _mm256_or_si256(*bad, _mm256_andnot_si256(_mm256_or_si256(digit, letter), _mm256_set1_epi8(-1)));
+    __m256i d = _mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0')));
+    __m256i l = _mm256_and_si256(letter, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)));
+    return _mm256_or_si256(d, l);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hex_pack_avx2(__m256i v)
+{
+    return _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(v, 4), _mm256_srli_epi16(v, 8)),
+        _mm256_set1_epi16(0xff));
+}
+
+__attribute__((target("avx2"))) static bool
+hex_decode_avx2(uint8_t *dst, const char *src, size_t n)
+{
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = hex_values_avx2(_mm256_loadu_si256((const __m256i *)(src + 2 * i)), &bad);
+        __m256i b = hex_values_avx2(_mm256_loadu_si256((const __m256i *)(src + 2 * i + 32)), &bad);
+        // the pack stays within the lanes too: a0 b0 a1 b1 -> a0 a1 b0 b1
+        __m256i v = _mm256_packus_epi16(hex_pack_avx2(a), hex_pack_avx2(b));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(v, 0xd8));
+    }
+    if (_mm256_movemask_epi8(bad))
+        return false;
+    return hex_decode_sse2(dst + i, src + 2 * i, n - i);
+}
+#endif
+
+static void (*s_hex_encode)(char *dst, const uint8_t *src, size_t n);
+static bool (*s_hex_decode)(uint8_t *dst, const char *src, size_t n);
+
+static inline void
+hex_init(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        s_hex_encode = hex_encode_avx2;
+        s_hex_decode = hex_decode_avx2;
+    } else {
+        s_hex_encode = hex_encode_sse2;
+        s_hex_decode = hex_decode_sse2;
+    }
+#else
+    s_hex_encode = hex_encode_scalar;
+    s_hex_decode = hex_decode_scalar;
+#endif
+}
+
+static inline void
+hex_encode(char *dst, const uint8_t *src, size_t n)
+{
+    if (!s_hex_encode)
+        hex_init();
+    s_hex_encode(dst, src, n);
+}
+
+static inline bool
+hex_decode(uint8_t *dst, const char *src, size_t n)
+{
+    if (!s_hex_decode)
+        hex_init();
+    return s_hex_decode(dst, src, n);
+}
+
+#endif
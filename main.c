@@ -1,9 +1,63 @@
+#define _GNU_SOURCE
 #include "mongoose.h"
+#include "hex.h"
+#include "tsc.h"
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/eventfd.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+// USDT probes for bpftrace/perf, a nop each while nobody traces them:
+//   bpftrace -e 'usdt:./proxy:relay:frame_drop { @[arg4] = count(); }'
+// They are built in when <sys/sdt.h> (systemtap-sdt-dev) is installed.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RELAY_PROBE(name, ...) STAP_PROBEV(relay, name, __VA_ARGS__)
+#endif
+#endif
+#ifndef RELAY_PROBE
+static inline void relay_probe_nop(int unused, ...) { (void)unused; }
+// arguments are not evaluated, only type checked
+#define RELAY_PROBE(name, ...) ((void)sizeof(relay_probe_nop(0, __VA_ARGS__), 0))
+#endif
 
 #define PROXY_AUTH_DATA 0xF0
 #define PROXY_GAME_DATA 0xF4
 
+// type of the game packet at offset 0 of PROXY_GAME_DATA, see gpgnet-mock.c
+#define MP_DAT 4
+#define MP_ACK 5
+#define MP_KPA 6
+
+// the game packet header, the MP_ACK built by kpa_offload() fills it
+struct MPHeader {
+    uint8_t type;
+    uint32_t mask;
+    uint16_t ser;           // packet serial, per sender
+    uint16_t irt;           // in reply to, the serial of the acked packet
+    uint16_t seq;           // the next MP_DAT sequence number of the sender
+    uint16_t expected;      // the next MP_DAT sequence number the sender expects
+    uint16_t len;
+    uint8_t data[0];
+} __attribute__((packed));
+
+#define MP_HEADER_LEN 15
+
+// frame_drop reasons
+enum DropReason {
+    DROP_UNKNOWN_PLAYER = 1,    // to_id is not connected
+    DROP_RATE_LIMIT,            // reserved, the relay doesn't limit rates yet
+    DROP_QUEUE_FULL,            // the recipient's shard queue is full
+    DROP_INVALID,               // not a game frame or not authenticated
+    DROP_STALE,                 // MP_DAT waited too long in the send queue, see sendq_drop()
+};
+
 #define PROXY_HEADER_LEN 11
 struct ProxyHeader {
     uint8_t type;
@@ -13,85 +67,2212 @@ struct ProxyHeader {
     char *data[0];
 } __attribute__((packed));
 
-struct ConState {
-    uint64_t recv_time;
-    uint32_t player_id;
-};
+// lives in mg_connection::data, must fit MG_DATA_SIZE
+struct ConState {
+    uint32_t recv_time;     // ms, wraps around
+    uint32_t active_time;   // last read or write, idle buffers are released after IDLE_RELEASE_MS
+    uint32_t player_id;
+    uint32_t game_id;
+    struct Game *game;
+    uint32_t deficit;       // bytes the connection may route, see sched_run
+    uint32_t ready;         // in Shard::ready
+    struct SendQueue *sendq;
+};
+
+#define CODEL_TARGET 25         // ms, default --codel
+#define CODEL_INTERVAL 100      // ms
+#define CODEL_MIN_BYTES 1500    // never drop from a queue shorter than that
+#define SENDQ_FRAMES 64         // the first frame ring, with the queue it fits a MG_IO_SIZE block
+#define NOTSENT_LOWAT 16384     // bytes, default --notsent-lowat
+
+// send lanes of a player, by priority
+enum Lane {
+    LANE_CONTROL,           // MP_ACK, MP_KPA and the other small non-MP_DAT frames, relay replies
+    LANE_SMALL,             // frames up to SCHED_SMALL_FRAME
+    LANE_BULK,
+    LANES
+};
+
+// --lanes
+enum LaneMode {
+    LANES_OFF,              // one FIFO
+    LANES_SIZE,             // by frame size
+    LANES_MP,               // by size and the MP type, default
+};
+
+#define LANE_COMMIT 4096        // bytes in c->send before frames wait in their lanes
+#define LANE_QUANTUM 1500       // weighted lanes, bytes per unit of weight and round
+
+// a frame in c->send
+struct SendFrame {
+    uint64_t end;           // stream offset after the frame
+    uint64_t time;          // ns, queued
+    uint32_t len;
+    uint16_t droppable;     // MP_DAT, may be dropped until it starts to go out
+    uint16_t lane;
+};
+
+// Every frame written to c->send is stamped, the time until the last byte
+// leaves it for the socket is the frame sojourn. When the smallest sojourn
+// stays above the target for an interval, the queue is standing and CoDel
+// drops MP_DAT frames that haven't started to go out, the next drop comes
+// sooner while the delay stays high. The game resends lost data on its own,
+// which beats delivering it late. TCP_NOTSENT_LOWAT keeps the kernel from
+// absorbing the queue into the socket buffer where it can't be seen.
+//
+// Only the first LANE_COMMIT bytes are committed to c->send, the frames
+// behind them wait in per-class lanes, so an MP_ACK doesn't queue behind a
+// map transfer. A lane entry is the queue time (8 bytes) and the frame.
+struct SendQueue {
+    struct mg_iobuf_allocator *allocator;   // the shard iobuf pool, NULL - malloc
+    struct SendFrame *frames;   // ring, power of two, right after the queue until it grows
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+    uint64_t sent;          // stream offset of c->send.buf[0]
+    struct mg_iobuf lanes[LANES];
+    int32_t credit[LANES];  // weighted lanes, bytes the lane may commit
+    uint32_t lane;          // weighted lanes, the lane being served
+    // CoDel
+    uint64_t first_above;   // ns, the delay is above the target since then + interval
+    uint64_t drop_next;
+    uint32_t count;
+    uint32_t last_count;
+    bool dropping;
+};
+
+struct SendQueueStats {
+    uint64_t frames;
+    uint64_t sojourn;       // ns, total
+    uint64_t max_sojourn;
+    uint64_t drops;
+    uint64_t lane_frames[LANES];
+    uint64_t lane_max_sojourn[LANES];
+};
+
+#define NAME player_map
+#define KEY_TY uint32_t
+#define VAL_TY struct mg_connection*
+#include "verstable.h"
+
+#define MAX_SHARDS 64
+#define SHARD_QUEUE_SIZE 4096 // power of two
+
+#define REBALANCE_INTERVAL 1000        // ms
+#define STEAL_MIN_LOAD 20000000ULL     // don't rebalance shards busy less than 20ms per interval
+
+#define IOPOOL_CLASSES 8                        // MG_IO_SIZE << 0 .. MG_IO_SIZE << 7
+#define IOPOOL_LARGE IOPOOL_CLASSES             // larger blocks go to malloc/realloc
+#define IOPOOL_CACHE_BYTES (4UL * 1024 * 1024)  // max free memory kept per class
+#define IOPOOL_TRIM_BYTES (256UL * 1024)        // give freed heap back to the OS after that much
+
+// header in front of every iobuf block
+struct IoBlock {
+    uint32_t cls;
+    uint32_t reserved;      // keeps the data 16 bytes aligned
+    uint64_t capacity;
+    union {
+        struct IoBlock *next_free;
+        uint8_t data[0];
+    };
+};
+
+struct IoPoolStats {
+    uint64_t allocs;        // new blocks handed out
+    uint64_t hits;          // ... taken from the free lists
+    uint64_t in_place;      // resizes that kept the block
+    uint64_t copies;        // resizes that moved the data to another block
+    uint64_t frees;
+    size_t in_use;          // bytes of live blocks
+    size_t cached;          // bytes kept in the free lists
+};
+
+// Per shard iobuf memory with power of two size classes, only the shard thread
+// uses it. A buffer grows inside its block without copying until it needs the
+// next class, blocks go back to the class free list.
+struct IoPool {
+    struct mg_iobuf_allocator allocator;
+    struct IoBlock *free_list[IOPOOL_CLASSES];
+    size_t free_bytes[IOPOOL_CLASSES];
+    size_t untrimmed;       // bytes passed to free() since the last malloc_trim
+    uint64_t tick_allocs;   // stats.allocs at the last tick
+    struct IoPoolStats stats;
+};
+
+#define CONNPOOL_SLAB 64     // connections allocated at once
+#define IDLE_RELEASE_MS 2000 // free empty iobufs of connections idle for that long
+
+// slab of connection slots, slabs stay allocated until the shard exits
+struct ConnSlab {
+    struct ConnSlab *next;
+    size_t slot_size;
+    uint8_t data[0];
+};
+
+// Per shard struct mg_connection memory. Connections are carved out of slabs
+// and freed slots go to a LIFO list, so a closed connection gives its hot
+// memory to the next accepted one and the heap doesn't fragment under churn.
+struct ConnPool {
+    struct mg_conn_allocator allocator;
+    struct ConnSlab *slabs;
+    void *free_list;
+    size_t slot_size;
+    size_t live;
+    size_t slab_bytes;
+};
+
+#define ARENA_CHUNK 1024           // bytes, larger requests get a chunk of their own
+#define ARENA_CACHE_CHUNKS 1024    // free chunks kept per shard
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;            // usable bytes
+    size_t used;
+    uint64_t data[0];
+};
+
+// Bump allocator, everything is released at once by arena_release
+struct Arena {
+    struct ArenaChunk *chunks;
+    size_t bytes;
+};
+
+// per shard cache of ARENA_CHUNK sized chunks shared by all arenas
+struct ArenaPool {
+    struct ArenaChunk *free_list;
+    size_t num_free;
+};
+
+#define SCHED_QUANTUM 16384     // bytes, default --quantum
+#define SCHED_SMALL_FRAME 256   // payload bytes, smaller frames are routed ahead of larger ones
+#define SCHED_BACKLOG 65536     // stop reading a connection with that much waiting in recv
+
+#define PROF_TOP 10 // players and games in the profile report
+
+enum ProfPhase {
+    PROF_READ,      // recv() syscall
+    PROF_PARSE,     // MG_EV_READ handler except routing
+    PROF_ROUTE,     // find the recipient and copy the frame to its send buffer
+    PROF_SEND,      // send() syscall
+    PROF_POLL,      // MG_EV_POLL handler
+    PROF_PHASES
+};
+
+// CPU cycles and syscalls of a player or a game, kept in c->prof and Game
+struct Prof {
+    uint64_t cycles[PROF_PHASES];
+    uint64_t recvs;
+    uint64_t sends;
+    uint64_t frames;
+};
+
+#define LAG_BUCKETS 24      // log2 of usec, the last one is 8s and more
+#define LAG_LOG_INTERVAL 1000 // ms between stall reports
+
+// Event loop lag of a shard. An iteration starts when epoll_wait returns,
+// i.e. at the first handler, and ends after the shard queue and the timers
+// are handled. Everything that happens in it delays every game on the shard.
+struct LoopLag {
+    uint64_t first;         // ns, first handler of the current iteration
+    uint64_t handlers;      // ns spent in handlers during the iteration
+    uint64_t events;
+    uint64_t worst;         // ns, the slowest handler of the iteration
+    unsigned long worst_conn;
+    uint32_t worst_player;
+    const char *worst_what; // event name
+    uint64_t busy[LAG_BUCKETS];     // first handler .. end of the iteration
+    uint64_t total[LAG_BUCKETS];    // whole iteration including epoll_wait
+    uint64_t max_busy;
+    uint64_t stalls;
+    uint64_t suppressed;    // stalls not logged because of LAG_LOG_INTERVAL
+    uint64_t next_log;
+};
+
+#define TRACE_TARGETS 16        // traced games and players at a time
+#define TRACE_SLOTS 16384       // records in the ring of a shard, power of two
+#define TRACE_SNAPLEN 96        // payload bytes kept in `trace ... payload` mode
+
+enum TraceMode {
+    TRACE_OFF,
+    TRACE_HEADERS,
+    TRACE_PAYLOAD,
+};
+
+enum TraceEvent {
+    TRACE_AUTH,
+    TRACE_ROUTE,        // sent to a player of the shard
+    TRACE_FORWARD,      // passed to another shard
+    TRACE_DROP,
+    TRACE_ANSWER,       // MP_KPA answered by the relay, see kpa_offload()
+};
+
+// game or player to trace, written by the control connection only
+struct TraceTarget {
+    atomic_uint id;     // 0 - free
+    atomic_int mode;
+};
+
+struct TraceSlot {
+    uint64_t time;      // ns
+    uint32_t game_id;
+    uint32_t from_id;
+    uint32_t to_id;
+    uint16_t len;       // frame payload length
+    uint8_t event;
+    uint8_t caplen;     // bytes in data
+    uint8_t data[TRACE_SNAPLEN];
+};
+
+// shared by the shards writing their rings to the same file
+struct TraceDump {
+    FILE *fp;
+    pthread_mutex_t lock;
+    atomic_int pending;     // shards yet to write, the last one closes the file
+};
+
+enum ShardMsgType {
+    SHARD_MSG_PACKET,       // packet for a player connected to the shard
+    SHARD_MSG_CONNECTION,   // connection moved to the shard
+    SHARD_MSG_GAME,         // game moved to the shard, its connections follow
+    SHARD_MSG_STEAL,        // idle shard asks for a game
+    SHARD_MSG_TRACE_DUMP,   // write the trace ring to a file
+};
+
+struct ShardMsg {
+    int type;
+    struct Shard *from;     // shard asking for a game
+    struct Game *game;      // moved game
+    struct TraceDump *dump;
+    uint32_t to_id;         // packet recipient
+    int fd;                 // moved connection socket
+    struct mg_addr loc;
+    struct mg_addr rem;
+    char state[MG_DATA_SIZE];
+    uint32_t len;           // packet length or unread bytes of the moved connection
+    uint32_t send_len;      // unsent bytes of the moved connection, follow the unread ones
+    uint8_t data[0];
+};
+
+struct ShardSlot {
+    atomic_size_t seq;
+    struct ShardMsg *msg;
+};
+
+// Bounded lock-free MPSC queue, any shard pushes, only the owner pops.
+// The owner sets `sleeping` before blocking in epoll_wait, a producer that
+// clears the flag rings the eventfd, so a batch of packets costs at most
+// one write() and nothing at all while the owner is busy.
+struct ShardQueue {
+    atomic_size_t head;
+    size_t tail;
+    atomic_int sleeping;
+    int efd;
+    struct mg_connection doorbell; // epoll_event.data.ptr for the eventfd, not in mgr->conns
+    atomic_ullong dropped;
+    struct ShardSlot slots[SHARD_QUEUE_SIZE];
+};
+
+// Every shard is an independent mg_mgr loop running in its own thread.
+// All memory of the shard connections is allocated by the shard thread,
+// so when the thread is pinned the first touch places it on the local NUMA node.
+struct Shard {
+    int id;
+    int cpu;                // -1 - not pinned
+    pthread_t thread;
+    struct mg_mgr mgr;
+    player_map players;     // players connected to this shard
+    uint64_t last_read;     // time of the last received data, used by the spin loop
+    struct ShardQueue queue;
+    struct Game *games;     // games served by the shard
+    uint64_t next_tick;
+    uint64_t next_stats;
+    struct IoPool iopool;
+    struct ConnPool connpool;
+    struct ArenaPool arenas;
+    bool profiling;
+    uint64_t prof_start;            // cycles
+    uint64_t prof_mark;             // end of the last handler
+    struct mg_connection *prof_con; // ... and its connection
+    struct LoopLag lag;
+    // allocated when a traced frame comes to the shard, only the shard thread uses it
+    struct TraceSlot *trace_ring;
+    uint64_t trace_head;
+    atomic_ullong load;     // ns spent on the shard games during the last interval
+    // connections with complete frames in recv, served round robin by sched_run
+    struct mg_connection **ready;
+    size_t num_ready;
+    size_t max_ready;
+    size_t sched_start;     // rotates the first one served
+    struct SendQueueStats sendq;    // since the last stats
+    uint64_t kpa_answered;          // --kpa-offload, since the last stats
+    uint64_t kpa_forwarded;
+    uint64_t kpa_remote;            // MP_KPA to a player not connected to this shard, relayed
+};
+
+// where to find a player connected to another shard
+struct PlayerRef {
+    struct Shard *shard;
+};
+
+#define KPA_PEER_TIMEOUT 10000  // ms, the relay doesn't answer for a peer silent longer than that
+
+// what the relay knows about the packets one player sends to another, see kpa_offload()
+struct KpaLink {
+    uint32_t to_id;
+    uint32_t mask;
+    uint16_t ser;
+    uint16_t seq;
+    uint16_t expected;
+    uint16_t reserved;
+    uint32_t heard;         // ms, the last packet
+    uint32_t forwarded;     // ms, the last MP_KPA let through to the peer
+};
+
+struct GameRoute {
+    uint32_t player_id;
+    struct mg_connection *c;    // NULL while the connection moves between shards
+    struct KpaLink *links;      // --kpa-offload, packets from the player by recipient
+    int num_links;
+    int max_links;
+};
+
+// All players of a game are served by its home shard, so forwarding
+// between teammates never leaves the thread. The game id is passed in
+// the `to_id` field of the auth packet, zero means no game.
+// The game lives in its own arena together with all its state, the last
+// player to leave releases the whole arena.
+struct Game {
+    uint32_t id;
+    struct Shard *home;
+    int num_players;
+    // owned by the home shard
+    struct Arena arena;
+    struct GameRoute *routes;   // num_players entries
+    int max_routes;
+    struct Game *next;
+    uint64_t frames;        // during the current interval
+    uint64_t cost;          // ns spent on the game packets during the current interval
+    uint64_t last_frames;
+    uint64_t last_cost;
+    struct Prof prof;
+    atomic_int trace;           // enum TraceMode
+};
+
+#define NAME game_dir
+#define KEY_TY uint32_t
+#define VAL_TY struct Game*
+#include "verstable.h"
+
+#define NAME player_dir
+#define KEY_TY uint32_t
+#define VAL_TY struct PlayerRef
+#include "verstable.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+static int s_signo;
+static atomic_int s_profile;  // toggled by SIGUSR1
+// set through the control connection
+static struct TraceTarget s_trace_games[TRACE_TARGETS];
+static struct TraceTarget s_trace_players[TRACE_TARGETS];
+static atomic_int s_traced_players;
+static struct Shard s_shards[MAX_SHARDS];
+// players and games of all shards
+static player_dir s_directory;
+static game_dir s_games;
+static pthread_rwlock_t s_directory_lock = PTHREAD_RWLOCK_INITIALIZER;
+// command line arguments
+static const char *s_port = "7788";
+static int s_busy_poll = 0;   // SO_BUSY_POLL usec, 0 - disabled
+static int s_spin_idle = 0;   // keep spinning for ms after the last read, 0 - disabled
+static int s_num_shards = 1;
+static int s_cpus[MAX_SHARDS];
+static int s_num_cpus = 0;
+static int s_incoming_cpu = 0;
+static int s_steal = 0;
+static int s_stats_interval = 0; // seconds, 0 - disabled
+static const char *s_control_port = NULL;
+static uint64_t s_stall = 5000000; // ns, log loop iterations longer than that, 0 - disabled
+static uint32_t s_quantum = SCHED_QUANTUM; // 0 - route everything as it comes
+static uint64_t s_codel_target = CODEL_TARGET * 1000000ULL; // ns, 0 - never drop
+static int s_notsent_lowat = NOTSENT_LOWAT; // 0 - kernel default
+static int s_lanes = LANES_MP;
+static uint32_t s_kpa_offload = 0;  // ms between MP_KPA let through to the peer, 0 - relay all
+static int s_lane_weights[LANES];   // all 0 - strict priority
+// all shards, used by the memory statistics
+static atomic_size_t s_num_conns;
+static size_t s_base_rss;
+
+static void
+signal_handler(int signo)
+{
+    if (signo == SIGUSR1) {
+        atomic_fetch_xor(&s_profile, 1);
+    } else {
+        s_signo = signo;
+    }
+}
+
+static struct mg_connection*
+find_player_con(struct Shard *shard, uint32_t player_id)
+{
+    player_map_itr it = vt_get(&shard->players, player_id);
+    return vt_is_end(it) ? NULL : it.data->val;
+}
+
+// like the iobufs the queue lives in the shard pool, NULL - malloc
+static void *
+sendq_resize(struct mg_iobuf_allocator *a, void *p, size_t len, size_t size)
+{
+    if (a)
+        return a->resize(a->ctx, p, len, size);
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+    return realloc(p, size);
+}
+
+// The queue and its first ring of SENDQ_FRAMES share one block, a connection
+// that starts to send takes a single MG_IO_SIZE block from the pool.
+static struct SendQueue *
+sendq_get(struct mg_connection *c)
+{
+    struct ConState *state = (struct ConState *)c->data;
+    struct SendQueue *q = state->sendq;
+    if (q)
+        return q;
+    q = (struct SendQueue *)sendq_resize(c->send.allocator, NULL, 0,
+        sizeof(*q) + SENDQ_FRAMES * sizeof(struct SendFrame));
+    if (!q)
+        return NULL;
+    memset(q, 0, sizeof(*q));
+    q->allocator = c->send.allocator;
+    q->frames = (struct SendFrame *)(q + 1);
+    q->mask = SENDQ_FRAMES - 1;
+    for (int i = 0; i < LANES; ++i) {
+        q->lanes[i].align = MG_IO_SIZE;
+        q->lanes[i].allocator = c->send.allocator;
+    }
+    // whatever is there already, e.g. brought from another shard, goes out as is
+    if (c->send.len) {
+        q->frames[0] = (struct SendFrame){ .end = c->send.len, .time = loop_ns(), .len = (uint32_t)c->send.len };
+        q->tail = 1;
+    }
+    state->sendq = q;
+    return q;
+}
+
+static void
+sendq_free(struct ConState *state)
+{
+    struct SendQueue *q = state->sendq;
+    if (q) {
+        for (int i = 0; i < LANES; ++i)
+            mg_iobuf_free(&q->lanes[i]);
+        if (q->frames != (struct SendFrame *)(q + 1))
+            sendq_resize(q->allocator, q->frames, 0, 0);
+        sendq_resize(q->allocator, q, 0, 0);
+        state->sendq = NULL;
+    }
+}
+
+static bool
+sendq_grow(struct SendQueue *q)
+{
+    uint32_t size = (q->mask + 1) * 2;
+    struct SendFrame *frames = (struct SendFrame *)sendq_resize(q->allocator, NULL, 0, size * sizeof(*frames));
+    if (!frames)
+        return false;
+    uint32_t n = q->tail - q->head;
+    for (uint32_t i = 0; i < n; ++i)
+        frames[i] = q->frames[(q->head + i) & q->mask];
+    if (q->frames != (struct SendFrame *)(q + 1))
+        sendq_resize(q->allocator, q->frames, 0, 0);
+    q->frames = frames;
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = n;
+    return true;
+}
+
+static bool
+sendq_waiting(struct SendQueue *q)
+{
+    for (int i = 0; i < LANES; ++i)
+        if (q->lanes[i].len)
+            return true;
+    return false;
+}
+
+static int
+frame_lane(struct ProxyHeader *pkt)
+{
+    if (pkt->type != PROXY_GAME_DATA || pkt->len == 0)
+        return LANE_CONTROL;
+    if (pkt->len > SCHED_SMALL_FRAME)
+        return LANE_BULK;
+    return s_lanes == LANES_MP && ((uint8_t *)pkt->data)[0] != MP_DAT ? LANE_CONTROL : LANE_SMALL;
+}
+
+// write the frame to c->send
+static void
+sendq_commit(struct mg_connection *c, struct SendQueue *q, struct ProxyHeader *pkt, size_t len, uint64_t time,
+    int lane)
+{
+    if (!mg_send(c, pkt, len))
+        return;
+    if (q->tail - q->head > q->mask && !sendq_grow(q)) {
+        // out of memory, the frame goes out with the previous one
+        struct SendFrame *last = &q->frames[(q->tail - 1) & q->mask];
+        last->end += len;
+        last->len += (uint32_t)len;
+        last->droppable = 0;
+        return;
+    }
+    q->frames[q->tail++ & q->mask] = (struct SendFrame){
+        .end = q->sent + c->send.len,
+        .time = time,
+        .len = (uint32_t)len,
+        .droppable = pkt->type == PROXY_GAME_DATA && pkt->len > 0 && ((uint8_t *)pkt->data)[0] == MP_DAT,
+        .lane = (uint16_t)lane,
+    };
+}
+
+static size_t
+lane_frame_len(struct mg_iobuf *lane, size_t offset)
+{
+    struct ProxyHeader *pkt = (struct ProxyHeader *)&lane->buf[offset + sizeof(uint64_t)];
+    return sizeof(uint64_t) + PROXY_HEADER_LEN + pkt->len;
+}
+
+// The lane to commit the next frame from, -1 if all are empty. Without
+// weights the first non-empty lane wins. With weights the lanes take turns
+// like the connections in sched_run(), a lane keeps the turn while its
+// credit covers the next frame.
+static int
+lane_pick(struct SendQueue *q, const size_t *taken)
+{
+    if (!s_lane_weights[0]) {
+        for (int i = 0; i < LANES; ++i)
+            if (taken[i] < q->lanes[i].len)
+                return i;
+        return -1;
+    }
+    for (;;) {
+        bool waiting = false;
+        for (int k = 0; k < LANES; ++k) {
+            int i = (int)((q->lane + k) % LANES);
+            if (taken[i] >= q->lanes[i].len) {
+                q->credit[i] = 0;
+                continue;
+            }
+            waiting = true;
+            if (q->credit[i] >= (int32_t)lane_frame_len(&q->lanes[i], taken[i])) {
+                q->lane = (uint32_t)i;
+                return i;
+            }
+        }
+        if (!waiting)
+            return -1;
+        for (int i = 0; i < LANES; ++i)
+            if (taken[i] < q->lanes[i].len)
+                q->credit[i] += s_lane_weights[i] * LANE_QUANTUM;
+    }
+}
+
+// move waiting frames to c->send until it holds limit bytes
+static void
+sendq_refill(struct mg_connection *c, struct SendQueue *q, size_t limit)
+{
+    size_t taken[LANES] = { 0 };
+    int i;
+    while (c->send.len < limit && (i = lane_pick(q, taken)) >= 0) {
+        uint64_t time;
+        size_t len = lane_frame_len(&q->lanes[i], taken[i]);
+        memcpy(&time, &q->lanes[i].buf[taken[i]], sizeof(time));
+        sendq_commit(c, q, (struct ProxyHeader *)&q->lanes[i].buf[taken[i] + sizeof(time)],
+            len - sizeof(time), time, i);
+        taken[i] += len;
+        q->credit[i] -= (int32_t)len;
+    }
+    for (i = 0; i < LANES; ++i)
+        if (taken[i])
+            mg_iobuf_del(&q->lanes[i], 0, taken[i]);
+}
+
+// all frames to a player go through here
+static void
+sendq_push(struct mg_connection *c, struct ProxyHeader *pkt, size_t len)
+{
+    struct SendQueue *q = sendq_get(c);
+    if (!q) {
+        mg_send(c, pkt, len);
+        return;
+    }
+    uint64_t now = loop_ns();
+    if (s_lanes == LANES_OFF || (c->send.len < LANE_COMMIT && !sendq_waiting(q))) {
+        sendq_commit(c, q, pkt, len, now, frame_lane(pkt));
+        return;
+    }
+    struct mg_iobuf *lane = &q->lanes[frame_lane(pkt)];
+    size_t offset = lane->len;
+    if (!mg_iobuf_add(lane, offset, &now, sizeof(now)) || !mg_iobuf_add(lane, offset + sizeof(now), pkt, len)) {
+        lane->len = offset;
+        sendq_commit(c, q, pkt, len, now, frame_lane(pkt));
+        return;
+    }
+    sendq_refill(c, q, LANE_COMMIT);
+}
+
+// Drop the MP_DAT frames queued longer than the target that haven't started
+// to go out. Game packets don't slow down when one of them is lost like TCP
+// does, so CoDel only decides when the queue is standing and what is stale
+// goes at once. Frames are stamped in order, the stale ones are at the front.
+static bool
+sendq_drop(struct Shard *shard, struct mg_connection *c, struct SendQueue *q, uint64_t now)
+{
+    uint64_t removed = 0, run = 0;  // bytes dropped, ... in the current run
+    size_t run_start = 0;           // c->send offset of the run
+    uint32_t out = q->head, i;
+    for (i = q->head; i != q->tail; ++i) {
+        struct SendFrame f = q->frames[i & q->mask];
+        if (now - f.time < s_codel_target)
+            break;
+        uint64_t start = f.end - f.len;
+        if (f.droppable && start >= q->sent) {
+            size_t offset = (size_t)(start - q->sent - removed);
+            if (!run)
+                run_start = offset;
+            struct ProxyHeader *pkt = (struct ProxyHeader *)&c->send.buf[offset];
+            RELAY_PROBE(frame_drop, ((struct ConState *)c->data)->game_id, pkt->from_id, pkt->to_id, pkt->len,
+                DROP_STALE);
+            run += f.len;
+            shard->sendq.drops++;
+            continue;
+        }
+        if (run) {
+            mg_iobuf_del(&c->send, run_start, run);
+            removed += run;
+            run = 0;
+        }
+        f.end -= removed;
+        q->frames[out++ & q->mask] = f;
+    }
+    if (run) {
+        mg_iobuf_del(&c->send, run_start, run);
+        removed += run;
+    }
+    for (; i != q->tail; ++i) {
+        q->frames[out & q->mask] = q->frames[i & q->mask];
+        q->frames[out++ & q->mask].end -= removed;
+    }
+    q->tail = out;
+    // the waiting frames are in order too
+    for (int l = 0; l < LANES; ++l) {
+        struct mg_iobuf *lane = &q->lanes[l];
+        size_t offset = 0;
+        while (offset < lane->len) {
+            uint64_t time;
+            struct ProxyHeader *pkt = (struct ProxyHeader *)&lane->buf[offset + sizeof(time)];
+            memcpy(&time, &lane->buf[offset], sizeof(time));
+            if (now - time < s_codel_target || pkt->type != PROXY_GAME_DATA || pkt->len == 0 ||
+                ((uint8_t *)pkt->data)[0] != MP_DAT)
+                break;
+            RELAY_PROBE(frame_drop, ((struct ConState *)c->data)->game_id, pkt->from_id, pkt->to_id, pkt->len,
+                DROP_STALE);
+            shard->sendq.drops++;
+            offset += lane_frame_len(lane, offset);
+        }
+        if (offset) {
+            mg_iobuf_del(lane, 0, offset);
+            removed += offset;
+        }
+    }
+    return removed > 0;
+}
+
+static uint64_t
+codel_next(uint64_t t, uint32_t count)
+{
+    // interval / sqrt(count)
+    uint32_t r = 1;
+    while ((r + 1) * (r + 1) <= count)
+        r++;
+    return t + CODEL_INTERVAL * 1000000ULL / r;
+}
+
+// RFC 8289 with the drop decision made on every send and poll
+static void
+codel(struct Shard *shard, struct mg_connection *c, struct SendQueue *q, uint64_t sojourn, uint64_t now)
+{
+    bool ok_to_drop = false;
+    if (sojourn < s_codel_target || c->send.len < CODEL_MIN_BYTES) {
+        q->first_above = 0;
+    } else if (q->first_above == 0) {
+        q->first_above = now + CODEL_INTERVAL * 1000000ULL;
+    } else {
+        ok_to_drop = now >= q->first_above;
+    }
+    if (q->dropping) {
+        if (!ok_to_drop) {
+            q->dropping = false;
+        } else if (now >= q->drop_next) {
+            if (sendq_drop(shard, c, q, now)) {
+                q->count++;
+                q->drop_next = codel_next(q->drop_next, q->count);
+            } else {
+                // nothing droppable is stale (ACKs, KPAs, frames going out), the rate must not build up
+                q->dropping = false;
+            }
+        }
+    } else if (ok_to_drop && sendq_drop(shard, c, q, now)) {
+        q->dropping = true;
+        // start close to the last drop rate if the queue was standing recently
+        uint32_t delta = q->count - q->last_count;
+        q->count = delta > 1 && now - q->drop_next < 16 * CODEL_INTERVAL * 1000000ULL ? delta : 1;
+        q->drop_next = codel_next(now, q->count);
+        q->last_count = q->count;
+    }
+}
+
+// n bytes went to the socket, the frames sent in full leave the queue
+static void
+sendq_sent(struct Shard *shard, struct mg_connection *c, long n)
+{
+    struct SendQueue *q = ((struct ConState *)c->data)->sendq;
+    if (!q || n <= 0)
+        return;
+    uint64_t now = loop_ns(), min_sojourn = UINT64_MAX;
+    q->sent += (uint64_t)n;
+    for (; q->head != q->tail && q->frames[q->head & q->mask].end <= q->sent; q->head++) {
+        struct SendFrame *f = &q->frames[q->head & q->mask];
+        uint64_t sojourn = now - f->time;
+        shard->sendq.frames++;
+        shard->sendq.sojourn += sojourn;
+        if (sojourn > shard->sendq.max_sojourn)
+            shard->sendq.max_sojourn = sojourn;
+        shard->sendq.lane_frames[f->lane]++;
+        if (sojourn > shard->sendq.lane_max_sojourn[f->lane])
+            shard->sendq.lane_max_sojourn[f->lane] = sojourn;
+        if (sojourn < min_sojourn)
+            min_sojourn = sojourn;
+    }
+    if (s_codel_target && min_sojourn != UINT64_MAX)
+        codel(shard, c, q, min_sojourn, now);
+    sendq_refill(c, q, LANE_COMMIT);
+}
+
+// a player that doesn't read at all sends nothing, look at the oldest frame
+static void
+sendq_poll(struct Shard *shard, struct mg_connection *c)
+{
+    struct SendQueue *q = ((struct ConState *)c->data)->sendq;
+    if (s_codel_target && q && q->head != q->tail) {
+        uint64_t now = loop_ns();
+        codel(shard, c, q, now - q->frames[q->head & q->mask].time, now);
+    }
+}
+
+static void
+sendq_stats(struct Shard *shard)
+{
+    struct SendQueueStats *st = &shard->sendq;
+    MG_INFO(("shard=%d send queue frames=%llu sojourn us: avg=%llu max=%llu codel drops=%llu", shard->id,
+        st->frames, st->frames ? st->sojourn / st->frames / 1000 : 0, st->max_sojourn / 1000, st->drops));
+    if (s_lanes != LANES_OFF)
+        MG_INFO(("shard=%d lanes frames/max sojourn us: control=%llu/%llu small=%llu/%llu bulk=%llu/%llu", shard->id,
+            st->lane_frames[LANE_CONTROL], st->lane_max_sojourn[LANE_CONTROL] / 1000,
+            st->lane_frames[LANE_SMALL], st->lane_max_sojourn[LANE_SMALL] / 1000,
+            st->lane_frames[LANE_BULK], st->lane_max_sojourn[LANE_BULK] / 1000));
+    memset(st, 0, sizeof(*st));
+}
+
+// zeroed memory from the arena of a game, NULL - out of memory. The standard
+// sized chunks are reused from the shard pool, a larger block gets its own chunk.
+static void *
+arena_alloc(struct ArenaPool *pool, struct Arena *arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    struct ArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK - sizeof(*chunk) ? size : ARENA_CHUNK - sizeof(*chunk);
+        if (chunk_size == ARENA_CHUNK - sizeof(*chunk) && pool->free_list) {
+            chunk = pool->free_list;
+            pool->free_list = chunk->next;
+            pool->num_free--;
+        } else if ((chunk = (struct ArenaChunk *)malloc(sizeof(*chunk) + chunk_size)) == NULL) {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        // keep bump allocating from the head chunk, a large block is used up at once
+        if (arena->chunks && chunk_size > ARENA_CHUNK - sizeof(*chunk)) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+        arena->bytes += sizeof(*chunk) + chunk_size;
+    }
+    void *p = (uint8_t *)chunk->data + chunk->used;
+    chunk->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+static void
+arena_release(struct ArenaPool *pool, struct Arena *arena)
+{
+    struct ArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        struct ArenaChunk *next = chunk->next;
+        if (chunk->size == ARENA_CHUNK - sizeof(*chunk) && pool->num_free < ARENA_CACHE_CHUNKS) {
+            chunk->next = pool->free_list;
+            pool->free_list = chunk;
+            pool->num_free++;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->bytes = 0;
+}
+
+static void
+arena_pool_free(struct ArenaPool *pool)
+{
+    while (pool->free_list) {
+        struct ArenaChunk *chunk = pool->free_list;
+        pool->free_list = chunk->next;
+        free(chunk);
+    }
+    pool->num_free = 0;
+}
+
+static int
+trace_mode(struct TraceTarget *targets, uint32_t id)
+{
+    for (int i = 0; i < TRACE_TARGETS; ++i) {
+        if (atomic_load_explicit(&targets[i].id, memory_order_relaxed) == id)
+            return atomic_load_explicit(&targets[i].mode, memory_order_relaxed);
+    }
+    return TRACE_OFF;
+}
+
+static struct Game *
+game_new(struct Shard *shard, uint32_t game_id)
+{
+    struct Arena arena = {0};
+    struct Game *game = (struct Game *)arena_alloc(&shard->arenas, &arena, sizeof(*game));
+    if (!game)
+        return NULL;
+    game->arena = arena;
+    game->id = game_id;
+    game->home = shard;
+    game->trace = trace_mode(s_trace_games, game_id);
+    return game;
+}
+
+// the Game itself is in the arena, don't touch it after the call
+static void
+game_free(struct Shard *shard, struct Game *game)
+{
+    struct Arena arena = game->arena;
+    arena_release(&shard->arenas, &arena);
+}
+
+static bool
+game_add_route(struct Shard *shard, struct Game *game, uint32_t player_id, struct mg_connection *c)
+{
+    if (game->num_players == game->max_routes) {
+        // the old table stays in the arena until the game ends, games are small
+        int max_routes = game->max_routes ? game->max_routes * 2 : 8;
+        struct GameRoute *routes = (struct GameRoute *)arena_alloc(&shard->arenas, &game->arena,
+            (size_t)max_routes * sizeof(*routes));
+        if (!routes)
+            return false;
+        if (game->num_players)
+            memcpy(routes, game->routes, (size_t)game->num_players * sizeof(*routes));
+        game->routes = routes;
+        game->max_routes = max_routes;
+    }
+    game->routes[game->num_players] = (struct GameRoute){ .player_id = player_id, .c = c };
+    game->num_players++;
+    return true;
+}
+
+static struct GameRoute *
+game_find_route(struct Game *game, uint32_t player_id)
+{
+    for (int i = 0; i < game->num_players; ++i) {
+        if (game->routes[i].player_id == player_id)
+            return &game->routes[i];
+    }
+    return NULL;
+}
+
+static void
+game_del_route(struct Game *game, uint32_t player_id)
+{
+    struct GameRoute *r = game_find_route(game, player_id);
+    if (r)
+        *r = game->routes[--game->num_players];
+}
+
+// Returns false if the player is already connected. If the game lives on another
+// shard `home` is set to that shard and the player is not registered.
+static bool
+register_player(struct Shard *shard, struct mg_connection *c, uint32_t player_id,
+    uint32_t game_id, struct Shard **home)
+{
+    struct ConState *state = (struct ConState *)c->data;
+    bool ok = false;
+    *home = shard;
+    pthread_rwlock_wrlock(&s_directory_lock);
+    if (vt_is_end(vt_get(&s_directory, player_id))) {
+        struct Game *game = NULL;
+        if (game_id) {
+            game_dir_itr it = vt_get(&s_games, game_id);
+            if (!vt_is_end(it)) {
+                game = it.data->val;
+            } else if ((game = game_new(shard, game_id)) != NULL) {
+                if (vt_is_end(vt_insert(&s_games, game_id, game))) {
+                    game_free(shard, game);
+                    game = NULL;
+                } else {
+                    LIST_ADD_HEAD(struct Game, &shard->games, game);
+                }
+            }
+            if (!game) {
+                MG_ERROR(("OOM"));
+                goto done;
+            }
+            *home = game->home;
+        }
+        if (*home == shard) {
+            struct PlayerRef ref = { .shard = shard };
+            ok = !vt_is_end(vt_insert(&s_directory, player_id, ref));
+            if (ok && game) {
+                if (game_add_route(shard, game, player_id, c)) {
+                    state->game = game;
+                } else {
+                    MG_ERROR(("OOM"));
+                    vt_erase(&s_directory, player_id);
+                    ok = false;
+                }
+            }
+        } else {
+            ok = true;
+        }
+    }
+done:
+    pthread_rwlock_unlock(&s_directory_lock);
+    if (ok && *home == shard)
+        vt_insert(&shard->players, player_id, c);
+    return ok;
+}
+
+static void
+unregister_player(struct Shard *shard, struct mg_connection *c, uint32_t player_id, uint32_t game_id)
+{
+    if (find_player_con(shard, player_id) != c)
+        return;
+    vt_erase(&shard->players, player_id);
+    pthread_rwlock_wrlock(&s_directory_lock);
+    player_dir_itr it = vt_get(&s_directory, player_id);
+    if (!vt_is_end(it) && it.data->val.shard == shard)
+        vt_erase_itr(&s_directory, it);
+    game_dir_itr git = vt_get(&s_games, game_id);
+    if (game_id && !vt_is_end(git)) {
+        struct Game *game = git.data->val;
+        game_del_route(game, player_id);
+        if (game->num_players == 0) {
+            MG_DEBUG(("game ended game_id=%u arena=%lu", game_id, (unsigned long)game->arena.bytes));
+            LIST_DELETE(struct Game, &shard->games, game);
+            vt_erase_itr(&s_games, git);
+            game_free(shard, game);
+        }
+    }
+    pthread_rwlock_unlock(&s_directory_lock);
+}
+
+static uint32_t
+iopool_class(size_t size)
+{
+    uint32_t cls = 0;
+    while (cls < IOPOOL_CLASSES && ((size_t)MG_IO_SIZE << cls) < size)
+        cls++;
+    return cls;
+}
+
+static void *
+iopool_alloc(struct IoPool *pool, size_t size)
+{
+    uint32_t cls = iopool_class(size);
+    size_t capacity = cls == IOPOOL_LARGE ? size : (size_t)MG_IO_SIZE << cls;
+    struct IoBlock *b = NULL;
+    if (cls < IOPOOL_CLASSES && (b = pool->free_list[cls]) != NULL) {
+        pool->free_list[cls] = b->next_free;
+        pool->free_bytes[cls] -= capacity;
+        pool->stats.cached -= capacity;
+        pool->stats.hits++;
+    } else if ((b = (struct IoBlock *)malloc(offsetof(struct IoBlock, data) + capacity)) == NULL) {
+        return NULL;
+    }
+    b->cls = cls;
+    b->capacity = capacity;
+    pool->stats.allocs++;
+    pool->stats.in_use += capacity;
+    return b->data;
+}
+
+static void
+iopool_release(struct IoPool *pool, struct IoBlock *b)
+{
+    pool->stats.frees++;
+    pool->stats.in_use -= b->capacity;
+    if (b->cls < IOPOOL_CLASSES && pool->free_bytes[b->cls] + b->capacity <= IOPOOL_CACHE_BYTES) {
+        b->next_free = pool->free_list[b->cls];
+        pool->free_list[b->cls] = b;
+        pool->free_bytes[b->cls] += b->capacity;
+        pool->stats.cached += b->capacity;
+    } else {
+        pool->untrimmed += b->capacity;
+        free(b);
+    }
+}
+
+static void *
+iopool_resize(void *ctx, void *buf, size_t len, size_t new_size)
+{
+    struct IoPool *pool = (struct IoPool *)ctx;
+    if (!buf)
+        return new_size ? iopool_alloc(pool, new_size) : NULL;
+    struct IoBlock *b = (struct IoBlock *)((uint8_t *)buf - offsetof(struct IoBlock, data));
+    if (new_size == 0) {
+        iopool_release(pool, b);
+        return NULL;
+    }
+    uint32_t cls = iopool_class(new_size);
+    if (cls == IOPOOL_LARGE && b->cls == IOPOOL_LARGE) {
+        // realloc may extend the block in place
+        struct IoBlock *nb = (struct IoBlock *)realloc(b, offsetof(struct IoBlock, data) + new_size);
+        if (!nb)
+            return NULL;
+        pool->stats.in_use += new_size - nb->capacity;
+        nb->capacity = new_size;
+        pool->stats.copies++;
+        return nb->data;
+    }
+    // keep the block unless the buffer shrinks to 1/8 of it
+    if (new_size <= b->capacity && (b->cls == 0 || new_size * 8 > b->capacity)) {
+        pool->stats.in_place++;
+        return buf;
+    }
+    void *p = iopool_alloc(pool, new_size);
+    if (!p)
+        return NULL;
+    memcpy(p, buf, len);
+    iopool_release(pool, b);
+    pool->stats.copies++;
+    return p;
+}
+
+static void
+iopool_init(struct IoPool *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->allocator.resize = iopool_resize;
+    pool->allocator.ctx = pool;
+}
+
+static void
+iopool_free(struct IoPool *pool)
+{
+    for (int i = 0; i < IOPOOL_CLASSES; ++i) {
+        while (pool->free_list[i]) {
+            struct IoBlock *b = pool->free_list[i];
+            pool->free_list[i] = b->next_free;
+            free(b);
+        }
+        pool->free_bytes[i] = 0;
+    }
+    pool->stats.cached = 0;
+}
+
+// Called once per tick. After a burst the freed blocks are scattered over the
+// heap and the cached ones pin their pages, so once the shard goes quiet drop
+// the cache and let malloc return the free pages to the OS.
+static void
+iopool_trim(struct IoPool *pool)
+{
+    bool quiet = pool->stats.allocs == pool->tick_allocs;
+    pool->tick_allocs = pool->stats.allocs;
+    if (pool->untrimmed + (quiet ? pool->stats.cached : 0) < IOPOOL_TRIM_BYTES)
+        return;
+    pool->untrimmed = 0;
+    iopool_free(pool);
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+}
+
+static void *
+connpool_alloc(void *ctx, size_t size)
+{
+    struct ConnPool *pool = (struct ConnPool *)ctx;
+    if (pool->slot_size == 0)
+        pool->slot_size = (size + 15) & ~(size_t)15;
+    if (size > pool->slot_size)
+        return NULL; // extraconnsize never changes
+    if (!pool->free_list) {
+        size_t len = offsetof(struct ConnSlab, data) + pool->slot_size * CONNPOOL_SLAB;
+        struct ConnSlab *slab = (struct ConnSlab *)malloc(len);
+        if (!slab)
+            return NULL;
+        slab->next = pool->slabs;
+        slab->slot_size = pool->slot_size;
+        pool->slabs = slab;
+        pool->slab_bytes += len;
+        for (int i = CONNPOOL_SLAB - 1; i >= 0; --i) {
+            void **slot = (void **)(slab->data + (size_t)i * pool->slot_size);
+            *slot = pool->free_list;
+            pool->free_list = slot;
+        }
+    }
+    void **slot = (void **)pool->free_list;
+    pool->free_list = *slot;
+    memset(slot, 0, pool->slot_size);
+    pool->live++;
+    atomic_fetch_add_explicit(&s_num_conns, 1, memory_order_relaxed);
+    return slot;
+}
+
+static void
+connpool_free(void *ctx, void *ptr)
+{
+    struct ConnPool *pool = (struct ConnPool *)ctx;
+    void **slot = (void **)ptr;
+    *slot = pool->free_list;
+    pool->free_list = slot;
+    pool->live--;
+    atomic_fetch_sub_explicit(&s_num_conns, 1, memory_order_relaxed);
+}
+
+static void
+connpool_init(struct ConnPool *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->allocator.alloc = connpool_alloc;
+    pool->allocator.free = connpool_free;
+    pool->allocator.ctx = pool;
+}
+
+static void
+connpool_free_all(struct ConnPool *pool)
+{
+    while (pool->slabs) {
+        struct ConnSlab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+}
+
+static size_t
+process_rss(void)
+{
+#if defined(__linux__)
+    long pages = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &rss) != 2)
+            rss = 0;
+        fclose(fp);
+    }
+    return (size_t)rss * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+static void
+shard_stats(struct Shard *shard)
+{
+    struct IoPoolStats *st = &shard->iopool.stats;
+    struct ConnPool *cp = &shard->connpool;
+    size_t conns = cp->live ? cp->live : 1;
+    size_t total = atomic_load_explicit(&s_num_conns, memory_order_relaxed);
+    size_t rss = process_rss();
+    // userspace cost of a connection of this shard: the pooled struct, its
+    // iobufs and the player map entry, the rss delta adds the heap overhead
+    // and the global directory
+    size_t games = 0, arena_bytes = 0;
+    for (struct Game *g = shard->games; g != NULL; g = g->next) {
+        games++;
+        arena_bytes += g->arena.bytes;
+    }
+    size_t user_bytes = cp->slab_bytes + st->in_use + vt_bucket_count(&shard->players) * (sizeof(player_map_bucket) + sizeof(uint16_t));
+    MG_INFO(("shard=%d conns=%lu iobuf in_use=%lukb cached=%lukb allocs=%llu hits=%llu in_place=%llu copies=%llu "
+        "connpool=%lukb bytes/conn=%lu games=%lu arena=%lukb arena_cached=%lukb rss=%lukb rss/conn=%lu",
+        shard->id, (unsigned long)cp->live, (unsigned long)(st->in_use / 1024), (unsigned long)(st->cached / 1024),
+        st->allocs, st->hits, st->in_place, st->copies, (unsigned long)(cp->slab_bytes / 1024),
+        (unsigned long)(user_bytes / conns), (unsigned long)games, (unsigned long)(arena_bytes / 1024),
+        (unsigned long)(shard->arenas.num_free * ARENA_CHUNK / 1024), (unsigned long)(rss / 1024),
+        (unsigned long)(rss > s_base_rss && total ? (rss - s_base_rss) / total : 0)));
+}
+
+// Profile of a connection, allocated on its first event after profiling is
+// switched on. mongoose uses c->prof only when built with MG_ENABLE_PROFILE.
+static struct Prof *
+con_prof(struct mg_connection *c)
+{
+#if MG_ENABLE_PROFILE
+    (void)c;
+    return NULL;
+#else
+    if (c->prof.len == 0) {
+        if (!mg_iobuf_resize(&c->prof, sizeof(struct Prof)))
+            return NULL;
+        c->prof.len = sizeof(struct Prof);
+    }
+    return (struct Prof *)c->prof.buf;
+#endif
+}
+
+static uint64_t
+prof_total(const struct Prof *p)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < PROF_PHASES; ++i)
+        total += p->cycles[i];
+    return total;
+}
+
+static int
+cmp_con_prof(const void *a, const void *b)
+{
+    uint64_t x = prof_total((struct Prof *)(*(struct mg_connection **)a)->prof.buf);
+    uint64_t y = prof_total((struct Prof *)(*(struct mg_connection **)b)->prof.buf);
+    return x > y ? -1 : x < y;
+}
+
+static int
+cmp_game_prof(const void *a, const void *b)
+{
+    uint64_t x = prof_total(&(*(struct Game **)a)->prof);
+    uint64_t y = prof_total(&(*(struct Game **)b)->prof);
+    return x > y ? -1 : x < y;
+}
+
+static void
+prof_log(const char *who, const struct Prof *p, uint64_t elapsed)
+{
+    uint64_t total = prof_total(p);
+    uint64_t bp = elapsed ? total * 10000 / elapsed : 0; // 0.01%
+    MG_INFO(("  %s cpu=%llu.%02llu%% kcycles: total=%llu read=%llu parse=%llu route=%llu send=%llu poll=%llu "
+        "recvs=%llu sends=%llu frames=%llu",
+        who, bp / 100, bp % 100, total / 1000,
+        p->cycles[PROF_READ] / 1000, p->cycles[PROF_PARSE] / 1000, p->cycles[PROF_ROUTE] / 1000,
+        p->cycles[PROF_SEND] / 1000, p->cycles[PROF_POLL] / 1000, p->recvs, p->sends, p->frames));
+}
+
+// top players and games by cycles since the last report, the counters start over
+static void
+prof_report(struct Shard *shard)
+{
+    uint64_t now = tsc_ticks(), elapsed = now - shard->prof_start;
+    size_t n = 0, num_games = 0;
+    for (struct mg_connection *c = shard->mgr.conns; c != NULL; c = c->next)
+        n += c->prof.len == sizeof(struct Prof);
+    for (struct Game *g = shard->games; g != NULL; g = g->next)
+        num_games++;
+    struct mg_connection **cons = (struct mg_connection **)calloc(n + 1, sizeof(*cons));
+    struct Game **games = (struct Game **)calloc(num_games + 1, sizeof(*games));
+    if (!cons || !games) {
+        MG_ERROR(("OOM"));
+        free(cons);
+        free(games);
+        return;
+    }
+    n = 0;
+    for (struct mg_connection *c = shard->mgr.conns; c != NULL; c = c->next) {
+        if (c->prof.len == sizeof(struct Prof))
+            cons[n++] = c;
+    }
+    num_games = 0;
+    for (struct Game *g = shard->games; g != NULL; g = g->next)
+        games[num_games++] = g;
+    qsort(cons, n, sizeof(*cons), cmp_con_prof);
+    qsort(games, num_games, sizeof(*games), cmp_game_prof);
+    MG_INFO(("shard=%d profile of %llu kcycles, top players:", shard->id, elapsed / 1000));
+    char who[64];
+    for (size_t i = 0; i < n && i < PROF_TOP; ++i) {
+        struct ConState *state = (struct ConState *)cons[i]->data;
+        mg_snprintf(who, sizeof(who), "player=%u game=%u", state->player_id, state->game_id);
+        prof_log(who, (struct Prof *)cons[i]->prof.buf, elapsed);
+    }
+    MG_INFO(("shard=%d top games:", shard->id));
+    for (size_t i = 0; i < num_games && i < PROF_TOP; ++i) {
+        mg_snprintf(who, sizeof(who), "game=%u players=%d", games[i]->id, games[i]->num_players);
+        prof_log(who, &games[i]->prof, elapsed);
+    }
+    for (size_t i = 0; i < n; ++i)
+        memset(cons[i]->prof.buf, 0, sizeof(struct Prof));
+    for (size_t i = 0; i < num_games; ++i)
+        memset(&games[i]->prof, 0, sizeof(struct Prof));
+    free(cons);
+    free(games);
+    shard->prof_start = now;
+}
+
+static void
+prof_toggle(struct Shard *shard, bool on)
+{
+#if MG_ENABLE_PROFILE
+    MG_ERROR(("shard=%d c->prof is used by MG_ENABLE_PROFILE", shard->id));
+    on = false;
+#endif
+    if (on) {
+        MG_INFO(("shard=%d profiling started", shard->id));
+        for (struct Game *g = shard->games; g != NULL; g = g->next)
+            memset(&g->prof, 0, sizeof(g->prof));
+        shard->prof_start = tsc_ticks();
+        shard->prof_con = NULL;
+    } else if (shard->profiling) {
+        prof_report(shard);
+#if !MG_ENABLE_PROFILE
+        for (struct mg_connection *c = shard->mgr.conns; c != NULL; c = c->next)
+            mg_iobuf_free(&c->prof);
+#endif
+    }
+    shard->profiling = on;
+}
+
+static bool
+queue_init(struct ShardQueue *q, struct mg_mgr *mgr)
+{
+    for (size_t i = 0; i < SHARD_QUEUE_SIZE; ++i)
+        atomic_init(&q->slots[i].seq, i);
+#if defined(__linux__)
+    if ((q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        MG_ERROR(("eventfd errno=%d", errno));
+        return false;
+    }
+    // mongoose only flags the dummy connection readable, the queue is drained by shard_loop
+    q->doorbell.mgr = mgr;
+    struct epoll_event ev = { EPOLLIN, { &q->doorbell } };
+    if (epoll_ctl(mgr->epoll_fd, EPOLL_CTL_ADD, q->efd, &ev) != 0) {
+        MG_ERROR(("epoll_ctl errno=%d", errno));
+        return false;
+    }
+#else
+    (void)mgr;
+#endif
+    return true;
+}
+
+static void
+queue_free(struct ShardQueue *q)
+{
+    struct ShardMsg *msg;
+    for (size_t i = 0; i < SHARD_QUEUE_SIZE; ++i) {
+        if ((msg = q->slots[i].msg) == NULL)
+            continue;
+        if (msg->type == SHARD_MSG_CONNECTION)
+            close(msg->fd);
+        free(msg);
+    }
+#if defined(__linux__)
+    if (q->efd > 0)
+        close(q->efd);
+#endif
+}
+
+// Take the next slot without filling it, NULL - the queue is full. The owner
+// stops at the slot until queue_commit(), what is pushed later waits behind it.
+static struct ShardSlot *
+queue_reserve(struct ShardQueue *q, size_t *pos)
+{
+    *pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        struct ShardSlot *slot = &q->slots[*pos & (SHARD_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)*pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, pos, *pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                return slot;
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            *pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+static void
+queue_commit(struct ShardQueue *q, struct ShardSlot *slot, size_t pos, struct ShardMsg *msg)
+{
+    slot->msg = msg;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_seq_cst);
+    if (atomic_exchange_explicit(&q->sleeping, 0, memory_order_seq_cst)) {
+#if defined(__linux__)
+        uint64_t one = 1;
+        if (write(q->efd, &one, sizeof(one)) < 0)
+            (void)0; // counter overflow only, the owner is awake anyway
+#endif
+    }
+}
+
+static bool
+queue_push(struct ShardQueue *q, struct ShardMsg *msg)
+{
+    size_t pos;
+    struct ShardSlot *slot = queue_reserve(q, &pos);
+    if (!slot)
+        return false; // full
+    queue_commit(q, slot, pos, msg);
+    return true;
+}
+
+static struct ShardMsg *
+queue_pop(struct ShardQueue *q)
+{
+    struct ShardSlot *slot = &q->slots[q->tail & (SHARD_QUEUE_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_seq_cst);
+    if (seq != q->tail + 1)
+        return NULL;
+    struct ShardMsg *msg = slot->msg;
+    slot->msg = NULL;
+    atomic_store_explicit(&slot->seq, q->tail + SHARD_QUEUE_SIZE, memory_order_release);
+    q->tail++;
+    return msg;
+}
+
+static bool
+queue_is_empty(struct ShardQueue *q)
+{
+    struct ShardSlot *slot = &q->slots[q->tail & (SHARD_QUEUE_SIZE - 1)];
+    return atomic_load_explicit(&slot->seq, memory_order_seq_cst) != q->tail + 1;
+}
+
+// deliver the packet to a player connected to another shard
+static bool
+forward_to_shard(struct Shard *shard, uint32_t game_id, struct ProxyHeader *pkt)
+{
+    pthread_rwlock_rdlock(&s_directory_lock);
+    player_dir_itr it = vt_get(&s_directory, pkt->to_id);
+    struct Shard *dst = vt_is_end(it) ? NULL : it.data->val.shard;
+    pthread_rwlock_unlock(&s_directory_lock);
+    if (!dst || dst == shard)
+        return false;
+    size_t len = sizeof(struct ProxyHeader) + pkt->len;
+    struct ShardMsg *msg = (struct ShardMsg *)malloc(sizeof(*msg) + len);
+    if (!msg) {
+        MG_ERROR(("OOM"));
+        return false;
+    }
+    RELAY_PROBE(frame_route, game_id, pkt->from_id, pkt->to_id, pkt->len, dst->id);
+    msg->type = SHARD_MSG_PACKET;
+    msg->to_id = pkt->to_id;
+    msg->len = (uint32_t)len;
+    memcpy(msg->data, pkt, len);
+    if (!queue_push(&dst->queue, msg)) {
+        RELAY_PROBE(frame_drop, game_id, pkt->from_id, pkt->to_id, pkt->len, DROP_QUEUE_FULL);
+        atomic_fetch_add_explicit(&dst->queue.dropped, 1, memory_order_relaxed);
+        MG_DEBUG(("shard=%d queue is full, drop packet to_id=%u", dst->id, pkt->to_id));
+        free(msg);
+    }
+    return true;
+}
+
+static void proxy_fn(struct mg_connection *c, int ev, void *ev_data);
+
+// Pass the connection with everything it has buffered to another shard, the
+// socket leaves this shard epoll set before the destination adds it to its own.
+static void
+move_connection(struct mg_connection *c, struct Shard *dst)
+{
+    struct Shard *shard = (struct Shard *)c->fn_data;
+    struct ConState *state = (struct ConState *)c->data;
+    struct ShardMsg *msg = (struct ShardMsg *)malloc(sizeof(*msg) + c->recv.len + c->send.len);
+    if (!msg) {
+        MG_ERROR(("OOM"));
+        c->is_closing = 1;
+        return;
+    }
+    msg->type = SHARD_MSG_CONNECTION;
+    msg->fd = (int)(size_t)c->fd;
+    msg->loc = c->loc;
+    msg->rem = c->rem;
+    // the new shard stamps the moved bytes again, the waiting frames go along in order
+    if (state->sendq)
+        sendq_refill(c, state->sendq, SIZE_MAX);
+    sendq_free(state);
+    memcpy(msg->state, c->data, sizeof(msg->state));
+    msg->len = (uint32_t)c->recv.len;
+    msg->send_len = (uint32_t)c->send.len;
+    memcpy(msg->data, c->recv.buf, c->recv.len);
+    memcpy(msg->data + c->recv.len, c->send.buf, c->send.len);
+#if MG_ENABLE_EPOLL
+    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, msg->fd, NULL);
+#endif
+    // mongoose frees the connection but doesn't close the socket
+    c->fd = (void *)(size_t)MG_INVALID_SOCKET;
+    c->recv.len = c->send.len = 0;
+    c->is_closing = 1;
+    if (state->player_id)
+        vt_erase(&shard->players, state->player_id);
+    if (!queue_push(&dst->queue, msg)) {
+        MG_ERROR(("shard=%d queue is full, drop connection", dst->id));
+        close(msg->fd);
+        free(msg);
+        return;
+    }
+    if (state->player_id) {
+        // packets that still come here are passed on by shard_drain
+        pthread_rwlock_wrlock(&s_directory_lock);
+        player_dir_itr it = vt_get(&s_directory, state->player_id);
+        if (!vt_is_end(it))
+            it.data->val.shard = dst;
+        pthread_rwlock_unlock(&s_directory_lock);
+        state->player_id = 0; // the player stays registered, MG_EV_CLOSE must not remove it
+    }
+}
+
+// Give the game to another shard at a quiescent point between polls:
+// new players go to the new home right away, then every connection moves.
+// The slot in the queue of dst is taken before `home` changes, so a full
+// queue leaves the game untouched, and the game message is ahead of any
+// player another shard sends to dst once it sees the new home.
+static void
+move_game(struct Shard *shard, struct Game *game, struct Shard *dst)
+{
+    struct ShardMsg *msg = (struct ShardMsg *)calloc(1, sizeof(*msg));
+    if (!msg)
+        return;
+    size_t pos;
+    struct ShardSlot *slot = queue_reserve(&dst->queue, &pos);
+    if (!slot) {
+        free(msg);
+        return;
+    }
+    msg->type = SHARD_MSG_GAME;
+    msg->game = game;
+    MG_INFO(("move game_id=%u shard=%d -> shard=%d cost=%lluus frames=%llu", game->id, shard->id, dst->id,
+        game->last_cost / 1000, game->last_frames));
+    // the game belongs to dst as soon as `home` is published, let go of it before
+    LIST_DELETE(struct Game, &shard->games, game);
+    // the connections are adopted by the new home one by one,
+    // meanwhile it finds them through the directory
+    for (int i = 0; i < game->num_players; ++i)
+        game->routes[i].c = NULL;
+    pthread_rwlock_wrlock(&s_directory_lock);
+    game->home = dst;
+    pthread_rwlock_unlock(&s_directory_lock);
+    queue_commit(&dst->queue, slot, pos, msg);
+    for (struct mg_connection *c = shard->mgr.conns; c != NULL; c = c->next) {
+        struct ConState *state = (struct ConState *)c->data;
+        if (!c->is_listening && !c->is_closing && state->game == game)
+            move_connection(c, dst);
+    }
+}
 
-#define NAME player_map
-#define KEY_TY uint32_t
-#define VAL_TY struct mg_connection*
-#include "verstable.h"
-player_map s_players;
+// steal request, give away the game that brings both shards closest to each other
+static void
+give_game(struct Shard *shard, struct Shard *thief)
+{
+    uint64_t load = atomic_load(&shard->load);
+    uint64_t thief_load = atomic_load(&thief->load);
+    if (load <= thief_load)
+        return;
+    uint64_t budget = (load - thief_load) / 2;
+    struct Game *best = NULL;
+    for (struct Game *g = shard->games; g != NULL; g = g->next) {
+        if (g->last_cost <= budget && (!best || g->last_cost > best->last_cost))
+            best = g;
+    }
+    if (best && best->last_cost > 0)
+        move_game(shard, best, thief);
+}
 
-static int s_signo;
-// command line arguments
-static const char *s_port = "7788";
+static void
+shard_tick(struct Shard *shard)
+{
+    uint64_t load = 0;
+    for (struct Game *g = shard->games; g != NULL; g = g->next) {
+        g->last_cost = g->cost;
+        g->last_frames = g->frames;
+        g->cost = g->frames = 0;
+        load += g->last_cost;
+    }
+    atomic_store(&shard->load, load);
+    iopool_trim(&shard->iopool);
+    if (!s_steal || s_num_shards == 1)
+        return;
+    struct Shard *busiest = NULL;
+    uint64_t max_load = 0;
+    for (int i = 0; i < s_num_shards; ++i) {
+        uint64_t l = atomic_load(&s_shards[i].load);
+        if (&s_shards[i] != shard && l > max_load) {
+            max_load = l;
+            busiest = &s_shards[i];
+        }
+    }
+    if (busiest && max_load > STEAL_MIN_LOAD && load * 2 < max_load) {
+        struct ShardMsg *msg = (struct ShardMsg *)calloc(1, sizeof(*msg));
+        if (!msg)
+            return;
+        msg->type = SHARD_MSG_STEAL;
+        msg->from = shard;
+        if (!queue_push(&busiest->queue, msg))
+            free(msg);
+    }
+}
 
 static void
-signal_handler(int signo)
+adopt_connection(struct Shard *shard, struct ShardMsg *msg)
+{
+    struct mg_connection *c = mg_wrapfd(&shard->mgr, msg->fd, proxy_fn, shard);
+    if (!c) {
+        MG_ERROR(("OOM"));
+        close(msg->fd);
+        return;
+    }
+    c->is_accepted = 1;
+    c->loc = msg->loc;
+    c->rem = msg->rem;
+    memcpy(c->data, msg->state, sizeof(c->data));
+    struct ConState *state = (struct ConState *)c->data;
+    // scheduled on the shard it came from
+    state->ready = 0;
+    state->deficit = 0;
+    mg_iobuf_add(&c->send, 0, msg->data + msg->len, msg->send_len);
+    mg_iobuf_add(&c->recv, 0, msg->data, msg->len);
+    if (state->player_id) {
+        vt_insert(&shard->players, state->player_id, c);
+        if (state->game) {
+            // the game may have been given away again while the connection was queued
+            pthread_rwlock_rdlock(&s_directory_lock);
+            struct Shard *home = state->game->home;
+            pthread_rwlock_unlock(&s_directory_lock);
+            if (home != shard) {
+                move_connection(c, home);
+                return;
+            }
+            struct GameRoute *r = game_find_route(state->game, state->player_id);
+            if (r)
+                r->c = c;
+        }
+    }
+    if (msg->len) {
+        long n = (long)msg->len;
+        mg_call(c, MG_EV_READ, &n);
+    }
+}
+
+// the last shard done with the dump closes the file
+static void
+trace_dump_release(struct TraceDump *dump)
 {
-    s_signo = signo;
+    if (atomic_fetch_sub(&dump->pending, 1) == 1) {
+        fclose(dump->fp);
+        pthread_mutex_destroy(&dump->lock);
+        free(dump);
+    }
 }
 
-static struct mg_connection*
-find_player_con(uint32_t player_id)
+// runs in the shard thread, the rest of the loop waits for the file write
+static void
+trace_dump(struct Shard *shard, struct TraceDump *dump)
 {
-    player_map_itr it = vt_get(&s_players, player_id);
-    return vt_is_end(it) ? NULL : it.data->val;
+    static const char *events[] = { "AUTH", "ROUTE", "FORWARD", "DROP", "ANSWER" };
+    uint64_t head = shard->trace_head;
+    uint64_t i = head > TRACE_SLOTS ? head - TRACE_SLOTS : 0;
+    pthread_mutex_lock(&dump->lock);
+    for (; shard->trace_ring && i < head; ++i) {
+        struct TraceSlot *t = &shard->trace_ring[i & (TRACE_SLOTS - 1)];
+        char hex[TRACE_SNAPLEN * 2 + 1];
+        hex_encode(hex, t->data, t->caplen);
+        hex[2 * t->caplen] = 0;
+        fprintf(dump->fp, "%llu\t%d\t%s\t%u\t%u\t%u\t%u\tx'%s'\n", (unsigned long long)t->time, shard->id,
+            events[t->event], t->game_id, t->from_id, t->to_id, t->len, hex);
+    }
+    pthread_mutex_unlock(&dump->lock);
+    MG_INFO(("shard=%d dumped %llu trace records", shard->id,
+        (unsigned long long)(head > TRACE_SLOTS ? TRACE_SLOTS : head)));
+    trace_dump_release(dump);
+}
+
+// handle messages passed by other shards, packet recipients are found by id in O(1)
+static void
+shard_drain(struct Shard *shard)
+{
+    struct ShardQueue *q = &shard->queue;
+    struct ShardMsg *msg;
+#if defined(__linux__)
+    if (q->doorbell.is_readable) {
+        uint64_t n;
+        if (read(q->efd, &n, sizeof(n)) < 0)
+            (void)0; // already reset
+        q->doorbell.is_readable = 0;
+    }
+#endif
+    while ((msg = queue_pop(q)) != NULL) {
+        if (msg->type == SHARD_MSG_CONNECTION) {
+            adopt_connection(shard, msg);
+        } else if (msg->type == SHARD_MSG_GAME) {
+            LIST_ADD_HEAD(struct Game, &shard->games, msg->game);
+        } else if (msg->type == SHARD_MSG_STEAL) {
+            give_game(shard, msg->from);
+        } else if (msg->type == SHARD_MSG_TRACE_DUMP) {
+            trace_dump(shard, msg->dump);
+        } else {
+            struct mg_connection *c = find_player_con(shard, msg->to_id);
+            struct ProxyHeader *pkt = (struct ProxyHeader *)msg->data;
+            if (c) {
+                RELAY_PROBE(frame_route, ((struct ConState *)c->data)->game_id, pkt->from_id, pkt->to_id,
+                    pkt->len, shard->id);
+                sendq_push(c, pkt, msg->len);
+            } else {
+                // the player may have moved to another shard after the packet was queued
+                pthread_rwlock_rdlock(&s_directory_lock);
+                player_dir_itr it = vt_get(&s_directory, msg->to_id);
+                struct Shard *dst = vt_is_end(it) ? NULL : it.data->val.shard;
+                pthread_rwlock_unlock(&s_directory_lock);
+                if (dst && dst != shard && queue_push(&dst->queue, msg))
+                    continue;
+                RELAY_PROBE(frame_drop, 0, pkt->from_id, pkt->to_id, pkt->len,
+                    dst && dst != shard ? DROP_QUEUE_FULL : DROP_UNKNOWN_PLAYER);
+                MG_DEBUG(("ignore, player %d is disconnected", msg->to_id));
+            }
+        }
+        free(msg);
+    }
+}
+
+static void
+set_busy_poll(struct mg_connection *c)
+{
+#if defined(__linux__)
+    int fd = (int)(size_t)c->fd;
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &s_busy_poll, sizeof(s_busy_poll)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) != 0) {
+        // raising the value above net.core.busy_poll requires CAP_NET_ADMIN
+        MG_ERROR(("busy poll is disabled, setsockopt errno=%d", errno));
+        s_busy_poll = 0;
+    }
+#else
+    (void)c;
+#endif
+}
+
+// Only frames of traced games and players come here, the check costs
+// a load of the game flag and of the traced players counter.
+static int
+frame_trace_mode(struct ConState *state, struct ProxyHeader *pkt)
+{
+    int mode = state->game ? atomic_load_explicit(&state->game->trace, memory_order_relaxed) : TRACE_OFF;
+    if (mode == TRACE_OFF && atomic_load_explicit(&s_traced_players, memory_order_relaxed)) {
+        int from = trace_mode(s_trace_players, pkt->from_id);
+        int to = trace_mode(s_trace_players, pkt->to_id);
+        mode = from > to ? from : to;
+    }
+    return mode;
+}
+
+static void
+trace_frame(struct Shard *shard, int mode, int event, uint32_t game_id, struct ProxyHeader *pkt)
+{
+    if (!shard->trace_ring &&
+        (shard->trace_ring = (struct TraceSlot *)calloc(TRACE_SLOTS, sizeof(struct TraceSlot))) == NULL)
+        return;
+    struct TraceSlot *t = &shard->trace_ring[shard->trace_head++ & (TRACE_SLOTS - 1)];
+    t->time = tsc_ns();
+    t->game_id = game_id;
+    t->from_id = pkt->from_id;
+    t->to_id = pkt->to_id;
+    t->len = pkt->len;
+    t->event = (uint8_t)event;
+    t->caplen = mode == TRACE_PAYLOAD ? (uint8_t)(pkt->len < TRACE_SNAPLEN ? pkt->len : TRACE_SNAPLEN) : 0;
+    memcpy(t->data, pkt->data, t->caplen);
+}
+
+static void
+set_notsent_lowat(struct mg_connection *c)
+{
+#if defined(__linux__)
+    int fd = (int)(size_t)c->fd;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &s_notsent_lowat, sizeof(s_notsent_lowat)) != 0) {
+        MG_ERROR(("TCP_NOTSENT_LOWAT is disabled, setsockopt errno=%d", errno));
+        s_notsent_lowat = 0;
+    }
+#else
+    (void)c;
+#endif
+}
+
+static struct KpaLink *
+kpa_find_link(struct GameRoute *r, uint32_t to_id)
+{
+    for (int i = 0; i < r->num_links; ++i) {
+        if (r->links[i].to_id == to_id)
+            return &r->links[i];
+    }
+    return NULL;
+}
+
+static struct KpaLink *
+kpa_add_link(struct Shard *shard, struct Game *game, struct GameRoute *r, uint32_t to_id)
+{
+    if (r->num_links == r->max_links) {
+        // like the routes, the old table stays in the arena until the game ends
+        int max_links = r->max_links ? r->max_links * 2 : 8;
+        struct KpaLink *links = (struct KpaLink *)arena_alloc(&shard->arenas, &game->arena,
+            (size_t)max_links * sizeof(*links));
+        if (!links)
+            return NULL;
+        if (r->num_links)
+            memcpy(links, r->links, (size_t)r->num_links * sizeof(*links));
+        r->links = links;
+        r->max_links = max_links;
+    }
+    struct KpaLink *link = &r->links[r->num_links++];
+    *link = (struct KpaLink){ .to_id = to_id };
+    return link;
+}
+
+// An idle game only exchanges MP_KPA and the MP_ACK for it, every 2 seconds
+// in both directions of every pair of players. With --kpa-offload the relay
+// answers an MP_KPA itself while both sides are idle: the peer sent something
+// recently and has seen all the MP_DAT of the sender and vice versa. The
+// MP_ACK is synthesized, the peer never sent it: it carries the mask, the
+// serial and the sequence numbers of the last packet of the peer like the
+// one the peer would send (nobody acks an MP_ACK, so reusing its serial is
+// safe). One MP_KPA per s_kpa_offload ms still goes through and the real
+// MP_ACK comes back, so a hung game is noticed by its peers.
+// Only a peer connected to this shard is answered for, the KpaLink of its
+// packets lives in its GameRoute here. An MP_KPA to a player on another shard,
+// or one whose connection is moving, is relayed as usual (kpa_remote).
+// Returns true if the frame was answered and must not be routed.
+static bool
+kpa_offload(struct Shard *shard, struct mg_connection *c, struct ConState *state, struct GameRoute *to,
+    struct ProxyHeader *pkt)
+{
+    struct GameRoute *from = game_find_route(state->game, state->player_id);
+    if (!from || pkt->len < MP_HEADER_LEN)
+        return false;
+    struct MPHeader *h = (struct MPHeader *)pkt->data;
+    struct KpaLink *link = kpa_find_link(from, pkt->to_id);
+    if (!link && (link = kpa_add_link(shard, state->game, from, pkt->to_id)) == NULL)
+        return false;
+    uint32_t now = (uint32_t)loop_ms();
+    link->mask = h->mask;
+    link->ser = h->ser;
+    link->seq = h->seq;
+    link->expected = h->expected;
+    link->heard = now;
+    if (h->type != MP_KPA)
+        return false;
+    struct KpaLink *back = kpa_find_link(to, state->player_id);
+    if (!back || now - back->heard > KPA_PEER_TIMEOUT || back->expected != h->seq || back->seq != h->expected)
+        return false;
+    if (now - link->forwarded >= s_kpa_offload) {
+        link->forwarded = now;
+        shard->kpa_forwarded++;
+        return false;
+    }
+    struct {
+        struct ProxyHeader pkt;
+        struct MPHeader mp;
+    } __attribute__((packed)) ack = {
+        .pkt = { .type = PROXY_GAME_DATA, .len = MP_HEADER_LEN, .from_id = pkt->to_id, .to_id = state->player_id },
+        .mp = { .type = MP_ACK, .mask = back->mask, .ser = back->ser, .irt = h->ser, .seq = back->seq,
+            .expected = back->expected },
+    };
+    sendq_push(c, &ack.pkt, sizeof(ack));
+    shard->kpa_answered++;
+    return true;
 }
 
 static int
 handle_packet(struct mg_connection *c, struct ConState *state, struct ProxyHeader *pkt)
 {
+    struct Shard *shard = (struct Shard *)c->fn_data;
     MG_DEBUG(("PKT %#X len=%u from_id=%u to_id=%u player_id=%u", pkt->type, pkt->len, pkt->from_id, pkt->to_id, state->player_id));
     if (!state->player_id) {
         // first packet must'be auth data
         if (pkt->type != PROXY_AUTH_DATA) {
+            RELAY_PROBE(frame_drop, 0, pkt->from_id, pkt->to_id, pkt->len, DROP_INVALID);
             c->is_draining = 1;
             MG_ERROR(("auth required"));
             return -1;
         }
-        if (find_player_con(pkt->from_id)) {
+        struct Shard *home;
+        if (!register_player(shard, c, pkt->from_id, pkt->to_id, &home)) {
             c->is_closing = 1;
             MG_ERROR(("already connected player_id=%u", pkt->from_id));
             return -1;
         }
+        if (home != shard) {
+            // the home shard handles the auth packet again and keeps serving the player
+            MG_DEBUG(("move player_id=%u to shard=%d game_id=%u", pkt->from_id, home->id, pkt->to_id));
+            move_connection(c, home);
+            return -1;
+        }
         state->player_id = pkt->from_id;
-        MG_DEBUG(("player connected player_id=%u", state->player_id));
-        vt_insert(&s_players, state->player_id, c);
+        state->game_id = pkt->to_id;
+        RELAY_PROBE(auth, state->game_id, state->player_id, c->id, shard->id);
+        int mode = frame_trace_mode(state, pkt);
+        if (mode != TRACE_OFF)
+            trace_frame(shard, mode, TRACE_AUTH, state->game_id, pkt);
+        MG_DEBUG(("player connected player_id=%u game_id=%u shard=%d", state->player_id, state->game_id, shard->id));
         pkt->len = 0;
-        mg_send(c, pkt, sizeof(struct ProxyHeader));
+        sendq_push(c, pkt, sizeof(struct ProxyHeader));
         return 0;
     }
+    RELAY_PROBE(frame_recv, state->game_id, state->player_id, pkt->to_id, pkt->len);
     if (pkt->type != PROXY_GAME_DATA) {
+        RELAY_PROBE(frame_drop, state->game_id, state->player_id, pkt->to_id, pkt->len, DROP_INVALID);
         MG_ERROR(("invalid proxy header type=%#x player_id=%u", pkt->type, state->player_id));
         return -1;
     }
-    struct mg_connection *rcon = find_player_con(pkt->to_id);
-    if(!rcon) {
-        MG_DEBUG(("ignore, player %d is disconnected", pkt->to_id));
+    // teammates first, the route table is a few cache lines
+    struct GameRoute *r = state->game ? game_find_route(state->game, pkt->to_id) : NULL;
+    struct mg_connection *rcon = r && r->c ? r->c : find_player_con(shard, pkt->to_id);
+    int event = TRACE_ROUTE;
+    if (s_kpa_offload && !(r && r->c) && pkt->len >= MP_HEADER_LEN && ((uint8_t *)pkt->data)[0] == MP_KPA)
+        shard->kpa_remote++;
+    if (s_kpa_offload && r && r->c && kpa_offload(shard, c, state, r, pkt)) {
+        event = TRACE_ANSWER;
+    } else if (rcon) {
+        RELAY_PROBE(frame_route, state->game_id, state->player_id, pkt->to_id, pkt->len, shard->id);
+        sendq_push(rcon, pkt, sizeof(struct ProxyHeader) + pkt->len);
+    } else if (s_num_shards > 1 && forward_to_shard(shard, state->game_id, pkt)) {
+        event = TRACE_FORWARD;
     } else {
-        mg_send(rcon, pkt, sizeof(struct ProxyHeader) + pkt->len);
+        RELAY_PROBE(frame_drop, state->game_id, state->player_id, pkt->to_id, pkt->len, DROP_UNKNOWN_PLAYER);
+        MG_DEBUG(("ignore, player %d is disconnected", pkt->to_id));
+        event = TRACE_DROP;
     }
+    int mode = frame_trace_mode(state, pkt);
+    if (mode != TRACE_OFF)
+        trace_frame(shard, mode, event, state->game_id, pkt);
     return 0;
 }
 
+static const char *
+event_name(int ev)
+{
+    static const char *names[] = {
+        "EV_ERROR", "EV_OPEN", "EV_POLL", "EV_RESOLVE", "EV_CONNECT",
+        "EV_ACCEPT", "EV_TLS_HS", "EV_READ", "EV_WRITE", "EV_CLOSE",
+    };
+    return ev >= 0 && ev < (int)(sizeof(names) / sizeof(names[0])) ? names[ev] : "EV_USER";
+}
+
 static void
-proxy_fn(struct mg_connection *c, int ev, void *ev_data)
+lag_blame(struct LoopLag *lag, uint64_t ns, unsigned long conn, uint32_t player, const char *what)
+{
+    lag->handlers += ns;
+    lag->events++;
+    if (ns > lag->worst) {
+        lag->worst = ns;
+        lag->worst_conn = conn;
+        lag->worst_player = player;
+        lag->worst_what = what;
+    }
+}
+
+// Fair share of the routing work. MG_EV_READ only queues the connection,
+// after the poll every queued one gets s_quantum bytes of credit (deficit
+// round robin). Small frames of all of them are routed first, then the larger
+// ones while the credit lasts, starting from another connection every time.
+// What doesn't fit waits in recv, and a connection with SCHED_BACKLOG waiting
+// isn't read until it catches up, so a bulk upload delays nobody's sim frames.
+// With --quantum 0 there is no queue, MG_EV_READ routes the frames itself.
+static void
+sched_add(struct Shard *shard, struct mg_connection *c)
+{
+    struct ConState *state = (struct ConState *)c->data;
+    if (state->ready)
+        return;
+    if (shard->num_ready == shard->max_ready) {
+        size_t max = shard->max_ready ? shard->max_ready * 2 : 64;
+        struct mg_connection **ready = (struct mg_connection **)realloc(shard->ready, max * sizeof(*ready));
+        if (!ready) {
+            MG_ERROR(("OOM"));
+            c->is_closing = 1;
+            return;
+        }
+        shard->ready = ready;
+        shard->max_ready = max;
+    }
+    shard->ready[shard->num_ready++] = c;
+    state->ready = 1;
+}
+
+static void
+sched_del(struct Shard *shard, struct mg_connection *c)
+{
+    struct ConState *state = (struct ConState *)c->data;
+    for (size_t i = 0; state->ready && i < shard->num_ready; ++i) {
+        if (shard->ready[i] == c) {
+            memmove(&shard->ready[i], &shard->ready[i + 1], (shard->num_ready - i - 1) * sizeof(c));
+            shard->num_ready--;
+            break;
+        }
+    }
+    state->ready = 0;
+    state->deficit = 0;
+    c->is_full = 0;
+}
+
+static bool
+sched_pending(struct mg_connection *c)
+{
+    struct ProxyHeader *pkt = (struct ProxyHeader *)c->recv.buf;
+    return c->recv.len >= PROXY_HEADER_LEN && c->recv.len >= PROXY_HEADER_LEN + (size_t)pkt->len;
+}
+
+// route frames of up to max_len bytes while the credit lasts, false - the connection is done
+static bool
+sched_route(struct Shard *shard, struct mg_connection *c, size_t max_len)
+{
+    struct ConState *state = (struct ConState *)c->data;
+    uint32_t player_id = state->player_id;
+    uint64_t start = tsc_ns(), frames = 0;
+    uint64_t route_start = shard->profiling ? tsc_ticks() : 0;
+    bool ok = true;
+    while (sched_pending(c)) {
+        struct ProxyHeader *pkt = (struct ProxyHeader *)c->recv.buf;
+        size_t msg_len = PROXY_HEADER_LEN + pkt->len;
+        if (pkt->len > max_len || msg_len > state->deficit)
+            break;
+        if (handle_packet(c, state, pkt) < 0) {
+            ok = false;
+            break;
+        }
+        mg_iobuf_del(&c->recv, 0, msg_len);
+        state->deficit -= (uint32_t)msg_len;
+        frames++;
+    }
+    if (!frames)
+        return ok;
+    uint64_t end = tsc_ns();
+    // the connection may have moved away together with its state
+    if (state->game && state->player_id) {
+        state->game->frames += frames;
+        state->game->cost += end - start;
+    }
+    struct Prof *prof = route_start ? con_prof(c) : NULL;
+    if (prof) {
+        uint64_t cycles = tsc_ticks() - route_start;
+        prof->cycles[PROF_ROUTE] += cycles;
+        prof->frames += frames;
+        if (state->game && state->player_id) {
+            state->game->prof.cycles[PROF_ROUTE] += cycles;
+            state->game->prof.frames += frames;
+        }
+    }
+    lag_blame(&shard->lag, end - start, c->id, player_id, "route");
+    return ok;
+}
+
+static void
+sched_run(struct Shard *shard)
+{
+    size_t n = shard->num_ready;
+    if (n == 0)
+        return;
+    size_t first = shard->sched_start++ % n;
+    for (size_t i = 0; i < n; ++i) {
+        struct mg_connection *c = shard->ready[(first + i) % n];
+        struct ConState *state = (struct ConState *)c->data;
+        // a frame larger than the quantum waits for a few rounds of credit
+        state->deficit = s_quantum && state->deficit < UINT32_MAX - s_quantum ? state->deficit + s_quantum : UINT32_MAX;
+        if (!c->is_closing && !c->is_draining)
+            sched_route(shard, c, SCHED_SMALL_FRAME);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        struct mg_connection *c = shard->ready[(first + i) % n];
+        if (!c->is_closing && !c->is_draining)
+            sched_route(shard, c, SIZE_MAX);
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct mg_connection *c = shard->ready[i];
+        struct ConState *state = (struct ConState *)c->data;
+        if (!c->is_closing && !c->is_draining && sched_pending(c)) {
+            shard->ready[k++] = c;
+            c->is_full = c->recv.len >= SCHED_BACKLOG;
+        } else {
+            state->ready = 0;
+            state->deficit = 0;
+            c->is_full = 0;
+        }
+    }
+    shard->num_ready = k;
+}
+
+static void
+relay_fn(struct mg_connection *c, int ev, void *ev_data)
 {
     struct ConState *state = (struct ConState*)c->data;
+    struct Shard *shard = (struct Shard *)c->fn_data;
     if (ev == MG_EV_OPEN) {
+        RELAY_PROBE(conn_open, c->id, shard->id, c->is_listening);
         //c->is_hexdumping = 1;
-        state->recv_time = mg_millis();
+        state->recv_time = state->active_time = (uint32_t)loop_ms();
+    } else if (ev == MG_EV_ACCEPT) {
+        if (s_busy_poll)
+            set_busy_poll(c);
+        if (s_notsent_lowat)
+            set_notsent_lowat(c);
     } else if (ev == MG_EV_CLOSE) {
+        RELAY_PROBE(conn_close, c->id, state->game_id, state->player_id, c->fd == (void *)(size_t)MG_INVALID_SOCKET);
         if (c->is_listening) {
-            MG_INFO(("shutdown"));
-        } else {
+            MG_INFO(("shutdown shard=%d", shard->id));
+        } else if (state->player_id) {
+            // frames that came before the FIN still go out
+            if (state->ready) {
+                state->deficit = UINT32_MAX;
+                sched_route(shard, c, SIZE_MAX);
+            }
             MG_DEBUG(("player disconnected player_id=%u", state->player_id));
-            vt_erase(&s_players, state->player_id);
+            unregister_player(shard, c, state->player_id, state->game_id);
         }
+        sched_del(shard, c);
+        sendq_free(state);
+    } else if (ev == MG_EV_WRITE) {
+        RELAY_PROBE(send_flush, state->game_id, state->player_id, *(long *)ev_data, c->send.len);
+        state->active_time = (uint32_t)loop_ms();
+        sendq_sent(shard, c, *(long *)ev_data);
     } else if (ev == MG_EV_POLL) {
+        // an idle player keeps only the struct, buffers come back on the next read or send
+        uint32_t now = (uint32_t)loop_ms();
+        if (!c->is_listening && (c->recv.size || c->send.size) && !c->recv.len && !c->send.len &&
+            (!state->sendq || !sendq_waiting(state->sendq)) && now - state->active_time > IDLE_RELEASE_MS) {
+            mg_iobuf_free(&c->recv);
+            mg_iobuf_free(&c->send);
+            sendq_free(state);
+        }
+        sendq_poll(shard, c);
         // if (c->is_listening || c->is_closing || c->is_draining) {
         //     return;
         // }
@@ -100,27 +2281,522 @@ proxy_fn(struct mg_connection *c, int ev, void *ev_data)
         //     c->is_closing = 1;
         // }
     } else if (ev == MG_EV_READ) {
-        state->recv_time = mg_millis();
-        while (c->recv.len >= PROXY_HEADER_LEN) {
-            struct ProxyHeader *pkt = (struct ProxyHeader *)c->recv.buf;
-            size_t msg_len = PROXY_HEADER_LEN + pkt->len;
-            if (c->recv.len < msg_len)
-                break; // wait for more data
-            if (handle_packet(c, state, pkt) < 0)
-                break;
-            mg_iobuf_del(&c->recv, 0, msg_len);
+        state->recv_time = state->active_time = (uint32_t)loop_ms();
+        shard->last_read = loop_ms();
+        if (s_quantum == 0) {
+            // --quantum 0, no scheduling: everything read is routed right away
+            state->deficit = UINT32_MAX;
+            sched_route(shard, c, SIZE_MAX);
+            state->deficit = 0;
+        } else if (sched_pending(c)) {
+            sched_add(shard, c);
+        }
+    }
+    (void)ev_data;
+}
+
+// With profiling on every event of a player is timed. mongoose calls
+// MG_EV_POLL, then reads and fires MG_EV_READ, then writes and fires
+// MG_EV_WRITE, so the gap since the previous handler of the same
+// connection is the recv() or send() syscall.
+static void
+prof_event(struct mg_connection *c, int ev, void *ev_data, struct Prof *prof)
+{
+    struct Shard *shard = (struct Shard *)c->fn_data;
+    struct ConState *state = (struct ConState *)c->data;
+    struct Game *game = state->player_id ? state->game : NULL;
+    struct Prof before = *prof;
+    uint64_t start = tsc_ticks();
+    uint64_t gap = shard->prof_con == c ? start - shard->prof_mark : 0;
+    relay_fn(c, ev, ev_data);
+    uint64_t end = tsc_ticks();
+    if (ev == MG_EV_READ) {
+        uint64_t route = prof->cycles[PROF_ROUTE] - before.cycles[PROF_ROUTE];
+        prof->cycles[PROF_READ] += gap;
+        prof->cycles[PROF_PARSE] += end - start - route;
+        prof->recvs++;
+    } else if (ev == MG_EV_WRITE) {
+        prof->cycles[PROF_SEND] += gap + end - start;
+        prof->sends++;
+    } else {
+        prof->cycles[PROF_POLL] += end - start;
+    }
+    // a moved connection doesn't own its game anymore
+    if (game && state->player_id && state->game == game) {
+        for (int i = 0; i < PROF_PHASES; ++i)
+            game->prof.cycles[i] += prof->cycles[i] - before.cycles[i];
+        game->prof.recvs += prof->recvs - before.recvs;
+        game->prof.sends += prof->sends - before.sends;
+        game->prof.frames += prof->frames - before.frames;
+    }
+    shard->prof_con = c;
+    shard->prof_mark = end;
+}
+
+static void
+proxy_fn(struct mg_connection *c, int ev, void *ev_data)
+{
+    struct Shard *shard = (struct Shard *)c->fn_data;
+    // c may be gone after MG_EV_CLOSE
+    unsigned long id = c->id;
+    uint32_t player_id = ((struct ConState *)c->data)->player_id;
+    uint64_t start = tsc_ns();
+    // the first handler after epoll_wait() returns
+    if (!shard->lag.first)
+        shard->lag.first = loop_clock_update();
+    struct Prof *prof = NULL;
+    if (shard->profiling && !c->is_listening &&
+        (ev == MG_EV_POLL || ev == MG_EV_READ || ev == MG_EV_WRITE))
+        prof = con_prof(c);
+    if (prof) {
+        prof_event(c, ev, ev_data, prof);
+    } else {
+        relay_fn(c, ev, ev_data);
+#if !MG_ENABLE_PROFILE
+        if (ev == MG_EV_CLOSE)
+            mg_iobuf_free(&c->prof);
+#endif
+    }
+    lag_blame(&shard->lag, tsc_ns() - start, id, player_id, event_name(ev));
+}
+
+static int
+lag_bucket(uint64_t ns)
+{
+    int i = 0;
+    for (uint64_t us = ns / 1000; us > 1 && i < LAG_BUCKETS - 1; us >>= 1)
+        i++;
+    return i;
+}
+
+// called at the end of every loop iteration
+static void
+lag_update(struct Shard *shard, uint64_t iter_start, uint64_t end)
+{
+    struct LoopLag *lag = &shard->lag;
+    uint64_t busy = lag->first && end > lag->first ? end - lag->first : 0;
+    lag->busy[lag_bucket(busy)]++;
+    lag->total[lag_bucket(end - iter_start)]++;
+    if (busy > lag->max_busy)
+        lag->max_busy = busy;
+    if (s_stall && busy > s_stall) {
+        lag->stalls++;
+        uint64_t now = end / 1000000;
+        if (now < lag->next_log) {
+            lag->suppressed++;
+        } else {
+            lag->next_log = now + LAG_LOG_INTERVAL;
+            // the time outside of handlers is spent in mongoose and syscalls
+            MG_ERROR(("shard=%d stall %lluus: %llu events took %lluus, the slowest %s conn=%lu player=%u %lluus, "
+                "%llu more stalls not logged",
+                shard->id, busy / 1000, lag->events, lag->handlers / 1000, lag->worst_what ? lag->worst_what : "?",
+                lag->worst_conn, lag->worst_player, lag->worst / 1000, lag->suppressed));
+            lag->suppressed = 0;
+        }
+    }
+    lag->first = 0;
+    lag->handlers = lag->events = 0;
+    lag->worst = 0;
+    lag->worst_what = NULL;
+}
+
+// upper bound of the bucket that holds the p-th iteration, usec
+static uint64_t
+lag_percentile(const uint64_t *hist, double p)
+{
+    uint64_t n = 0, seen = 0;
+    for (int i = 0; i < LAG_BUCKETS; ++i)
+        n += hist[i];
+    uint64_t rank = (uint64_t)(p * (double)n);
+    for (int i = 0; i < LAG_BUCKETS; ++i) {
+        seen += hist[i];
+        if (seen > rank)
+            return 2ULL << i;
+    }
+    return 0;
+}
+
+static void
+lag_stats(struct Shard *shard)
+{
+    struct LoopLag *lag = &shard->lag;
+    uint64_t n = 0;
+    char hist[LAG_BUCKETS * 12] = "";
+    size_t len = 0;
+    for (int i = 0; i < LAG_BUCKETS; ++i) {
+        n += lag->busy[i];
+        if (lag->busy[i])
+            len += mg_snprintf(hist + len, sizeof(hist) - len, " <%llu:%llu", 2ULL << i, lag->busy[i]);
+    }
+    MG_INFO(("shard=%d loop iterations=%llu busy us: p50<%llu p99<%llu p999<%llu max=%llu stalls=%llu iteration p99<%llu",
+        shard->id, n, lag_percentile(lag->busy, 0.5), lag_percentile(lag->busy, 0.99),
+        lag_percentile(lag->busy, 0.999), lag->max_busy / 1000, lag->stalls, lag_percentile(lag->total, 0.99)));
+    MG_INFO(("shard=%d busy histogram us:%s", shard->id, hist));
+    memset(lag->busy, 0, sizeof(lag->busy));
+    memset(lag->total, 0, sizeof(lag->total));
+    lag->max_busy = lag->stalls = 0;
+}
+
+// add, update or remove (mode TRACE_OFF) a traced game or player, id 0 - all of them
+static bool
+trace_set(struct TraceTarget *targets, uint32_t id, int mode)
+{
+    struct TraceTarget *free_slot = NULL;
+    for (int i = 0; i < TRACE_TARGETS; ++i) {
+        uint32_t target = atomic_load(&targets[i].id);
+        if (target && (target == id || (id == 0 && mode == TRACE_OFF))) {
+            atomic_store(&targets[i].mode, mode);
+            if (mode == TRACE_OFF)
+                atomic_store(&targets[i].id, 0);
+            if (id)
+                return true;
+        } else if (!target && !free_slot) {
+            free_slot = &targets[i];
+        }
+    }
+    if (mode == TRACE_OFF)
+        return true;
+    if (!free_slot)
+        return false;
+    atomic_store(&free_slot->mode, mode);
+    atomic_store(&free_slot->id, id);
+    return true;
+}
+
+static void
+trace_update(void)
+{
+    int players = 0;
+    for (int i = 0; i < TRACE_TARGETS; ++i)
+        players += atomic_load(&s_trace_players[i].id) != 0;
+    atomic_store(&s_traced_players, players);
+    // games being played, new ones check the targets when they are created
+    pthread_rwlock_rdlock(&s_directory_lock);
+    for (game_dir_itr it = vt_first(&s_games); !vt_is_end(it); it = vt_next(it))
+        atomic_store(&it.data->val->trace, trace_mode(s_trace_games, it.data->key));
+    pthread_rwlock_unlock(&s_directory_lock);
+}
+
+static void
+control_reply(struct mg_connection *c, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, &ap);
+    va_end(ap);
+    mg_send(c, "\n", 1);
+}
+
+static void
+control_dump(struct mg_connection *c, struct mg_str path)
+{
+    char name[256];
+    if (path.len == 0 || path.len >= sizeof(name)) {
+        control_reply(c, "error: bad file name");
+        return;
+    }
+    memcpy(name, path.buf, path.len);
+    name[path.len] = 0;
+    struct TraceDump *dump = (struct TraceDump *)calloc(1, sizeof(*dump));
+    if (!dump || (dump->fp = fopen(name, "w")) == NULL) {
+        control_reply(c, "error: can't open %s, errno=%d", name, errno);
+        free(dump);
+        return;
+    }
+    fprintf(dump->fp, "time_ns\tshard\tevent\tgame_id\tfrom_id\tto_id\tlen\tdata\n");
+    pthread_mutex_init(&dump->lock, NULL);
+    // +1 until every message is pushed, so no shard closes the file too early
+    atomic_store(&dump->pending, s_num_shards + 1);
+    for (int i = 0; i < s_num_shards; ++i) {
+        struct ShardMsg *msg = (struct ShardMsg *)calloc(1, sizeof(*msg));
+        if (msg) {
+            msg->type = SHARD_MSG_TRACE_DUMP;
+            msg->dump = dump;
+        }
+        if (!msg || !queue_push(&s_shards[i].queue, msg)) {
+            free(msg);
+            trace_dump_release(dump);
+        }
+    }
+    control_reply(c, "ok, dumping %d shards to %s", s_num_shards, name);
+    trace_dump_release(dump);
+}
+
+static void
+control_command(struct mg_connection *c, struct mg_str line)
+{
+    struct mg_str cmd, kind, id, opt;
+    uint32_t n = 0;
+    mg_span(line, &cmd, &line, ' ');
+    mg_span(line, &kind, &line, ' ');
+    mg_span(line, &id, &line, ' ');
+    mg_span(line, &opt, &line, ' ');
+    bool game = mg_strcmp(kind, mg_str("game")) == 0;
+    bool player = mg_strcmp(kind, mg_str("player")) == 0;
+    if (mg_strcmp(cmd, mg_str("trace")) == 0 && (game || player) && mg_str_to_num(id, 10, &n, sizeof(n)) && n) {
+        int mode = mg_strcmp(opt, mg_str("payload")) == 0 ? TRACE_PAYLOAD : TRACE_HEADERS;
+        if (!trace_set(game ? s_trace_games : s_trace_players, n, mode)) {
+            control_reply(c, "error: at most %d traced %ss", TRACE_TARGETS, game ? "game" : "player");
+            return;
+        }
+        trace_update();
+        control_reply(c, "ok");
+    } else if (mg_strcmp(cmd, mg_str("untrace")) == 0 && mg_strcmp(kind, mg_str("all")) == 0) {
+        trace_set(s_trace_games, 0, TRACE_OFF);
+        trace_set(s_trace_players, 0, TRACE_OFF);
+        trace_update();
+        control_reply(c, "ok");
+    } else if (mg_strcmp(cmd, mg_str("untrace")) == 0 && (game || player) && mg_str_to_num(id, 10, &n, sizeof(n)) && n) {
+        trace_set(game ? s_trace_games : s_trace_players, n, TRACE_OFF);
+        trace_update();
+        control_reply(c, "ok");
+    } else if (mg_strcmp(cmd, mg_str("list")) == 0) {
+        for (int i = 0; i < TRACE_TARGETS; ++i) {
+            if (atomic_load(&s_trace_games[i].id))
+                control_reply(c, "game %u%s", atomic_load(&s_trace_games[i].id),
+                    atomic_load(&s_trace_games[i].mode) == TRACE_PAYLOAD ? " payload" : "");
+            if (atomic_load(&s_trace_players[i].id))
+                control_reply(c, "player %u%s", atomic_load(&s_trace_players[i].id),
+                    atomic_load(&s_trace_players[i].mode) == TRACE_PAYLOAD ? " payload" : "");
+        }
+        control_reply(c, "ok");
+    } else if (mg_strcmp(cmd, mg_str("dump")) == 0) {
+        control_dump(c, kind);
+    } else {
+        control_reply(c, "commands:\n"
+            "trace game|player <id> [payload]\n"
+            "untrace game|player <id>\n"
+            "untrace all\n"
+            "list\n"
+            "dump <file>");
+    }
+}
+
+// line based commands, see `help`
+static void
+control_fn(struct mg_connection *c, int ev, void *ev_data)
+{
+    if (ev == MG_EV_READ) {
+        char *nl;
+        while ((nl = (char *)memchr(c->recv.buf, '\n', c->recv.len)) != NULL) {
+            size_t len = (size_t)(nl - (char *)c->recv.buf);
+            struct mg_str line = mg_str_n((char *)c->recv.buf, len);
+            while (line.len && (line.buf[line.len - 1] == '\r' || line.buf[line.len - 1] == ' '))
+                line.len--;
+            if (line.len)
+                control_command(c, line);
+            mg_iobuf_del(&c->recv, 0, len + 1);
         }
+        if (c->recv.len > 1024)
+            c->is_draining = 1;
+    } else if (ev == MG_EV_ACCEPT) {
+        MG_INFO(("control connection from %M", mg_print_ip_port, &c->rem));
     }
     (void)ev_data;
 }
 
+static bool
+pin_thread(struct Shard *shard)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(shard->cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        MG_ERROR(("shard=%d can't pin to cpu=%d errno=%d", shard->id, shard->cpu, errno));
+        return false;
+    }
+    return true;
+#else
+    MG_ERROR(("cpu pinning is not supported"));
+    return false;
+#endif
+}
+
+// SO_REUSEPORT listener, the kernel spreads new connections between shards by 4-tuple hash
+static struct mg_connection*
+shard_listen(struct Shard *shard)
+{
+#if defined(__linux__)
+    int fd, on = 1;
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = mg_htons((uint16_t)atoi(s_port)),
+    };
+    if ((fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+        MG_ERROR(("socket errno=%d", errno));
+        return NULL;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+        (s_incoming_cpu && shard->cpu >= 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &shard->cpu, sizeof(shard->cpu)) != 0) ||
+        bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(fd, MG_SOCK_LISTEN_BACKLOG_SIZE) != 0) {
+        MG_ERROR(("shard=%d listen on port %s failed, errno=%d", shard->id, s_port, errno));
+        close(fd);
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    struct mg_connection *c = mg_wrapfd(&shard->mgr, fd, proxy_fn, shard);
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+    c->is_listening = 1;
+    c->loc.port = sin.sin_port;
+    return c;
+#else
+    char url[100];
+    mg_snprintf(url, sizeof(url), "tcp://0.0.0.0:%s", s_port);
+    return mg_listen(&shard->mgr, url, proxy_fn, shard);
+#endif
+}
+
+static void *
+shard_loop(void *arg)
+{
+    struct Shard *shard = (struct Shard *)arg;
+    // pin before the first allocation, the shard memory stays on the local node
+    if (shard->cpu >= 0)
+        pin_thread(shard);
+    vt_init(&shard->players);
+    mg_mgr_init(&shard->mgr);
+    iopool_init(&shard->iopool);
+    shard->mgr.iobuf_allocator = &shard->iopool.allocator;
+    connpool_init(&shard->connpool);
+    shard->mgr.conn_allocator = &shard->connpool.allocator;
+    shard->mgr.io_budget = s_quantum;
+    if (!queue_init(&shard->queue, &shard->mgr) || !shard_listen(shard)) {
+        s_signo = SIGTERM;
+        return NULL;
+    }
+    MG_INFO(("shard=%d cpu=%d is listening on port %s", shard->id, shard->cpu, s_port));
+    if (shard->id == 0 && s_control_port) {
+        char url[100];
+        mg_snprintf(url, sizeof(url), "tcp://127.0.0.1:%s", s_control_port);
+        if (!mg_listen(&shard->mgr, url, control_fn, NULL)) {
+            s_signo = SIGTERM;
+            return NULL;
+        }
+        MG_INFO(("control is listening on %s", url));
+    }
+    while (s_signo == 0) {
+        // dedicated core mode: don't sleep in epoll_wait while players are active
+        bool spin = shard->num_ready > 0 ||
+            (s_spin_idle > 0 && loop_ms() - shard->last_read < (uint64_t)s_spin_idle);
+        if (!spin) {
+            atomic_store_explicit(&shard->queue.sleeping, 1, memory_order_seq_cst);
+            // a producer may have pushed before it could see the flag
+            spin = !queue_is_empty(&shard->queue);
+        }
+        uint64_t iter_start = tsc_ns();
+        shard->lag.first = 0;
+        mg_mgr_poll(&shard->mgr, spin ? 0 : 5);
+        atomic_store_explicit(&shard->queue.sleeping, 0, memory_order_relaxed);
+        uint64_t t = loop_clock_update();
+        sched_run(shard);
+        t = tsc_ns();
+        shard_drain(shard);
+        lag_blame(&shard->lag, tsc_ns() - t, 0, 0, "shard queue");
+        bool profile = atomic_load_explicit(&s_profile, memory_order_relaxed) != 0;
+        if (profile != shard->profiling)
+            prof_toggle(shard, profile);
+        uint64_t now = loop_ms();
+        if (now >= shard->next_tick) {
+            t = tsc_ns();
+            shard->next_tick = now + REBALANCE_INTERVAL;
+            shard_tick(shard);
+            lag_blame(&shard->lag, tsc_ns() - t, 0, 0, "tick");
+        }
+        if (s_stats_interval && now >= shard->next_stats) {
+            t = tsc_ns();
+            shard->next_stats = now + (uint64_t)s_stats_interval * 1000;
+            shard_stats(shard);
+            sendq_stats(shard);
+            if (s_kpa_offload) {
+                MG_INFO(("shard=%d MP_KPA answered=%llu forwarded=%llu remote=%llu", shard->id,
+                    shard->kpa_answered, shard->kpa_forwarded, shard->kpa_remote));
+                shard->kpa_answered = shard->kpa_forwarded = shard->kpa_remote = 0;
+            }
+            lag_stats(shard);
+            if (shard->profiling)
+                prof_report(shard);
+            lag_blame(&shard->lag, tsc_ns() - t, 0, 0, "stats");
+        }
+        lag_update(shard, iter_start, tsc_ns());
+    }
+    return NULL;
+}
+
+static int
+parse_cpus(const char *s)
+{
+    struct mg_str list = mg_str(s), k;
+    s_num_cpus = 0;
+    while (s_num_cpus < MAX_SHARDS && mg_span(list, &k, &list, ',')) {
+        int cpu = 0;
+        if (!mg_str_to_num(k, 10, &cpu, sizeof(cpu)) || cpu < 0)
+            return -1;
+        s_cpus[s_num_cpus++] = cpu;
+    }
+    return s_num_cpus > 0 ? 0 : -1;
+}
+
+static int
+parse_lanes(const char *s)
+{
+    if (mg_casecmp(s, "off") == 0)
+        s_lanes = LANES_OFF;
+    else if (mg_casecmp(s, "size") == 0)
+        s_lanes = LANES_SIZE;
+    else if (mg_casecmp(s, "mp") == 0)
+        s_lanes = LANES_MP;
+    else
+        return -1;
+    return 0;
+}
+
+static int
+parse_lane_weights(const char *s)
+{
+    struct mg_str list = mg_str(s), k;
+    int n = 0;
+    while (n < LANES && mg_span(list, &k, &list, ',')) {
+        int weight = 0;
+        if (!mg_str_to_num(k, 10, &weight, sizeof(weight)) || weight < 1 || weight > 1000)
+            return -1;
+        s_lane_weights[n++] = weight;
+    }
+    return n == LANES && list.len == 0 ? 0 : -1;
+}
+
 static void
 usage(const char *prog)
 {
     fprintf(stderr,
         "%s usage:\n"
         "--help                           show help message\n"
-        "--port arg                       set the proxy port\n",
+        "--port arg                       set the proxy port\n"
+        "--spin ms                        poll without sleeping, block again after ms of idle\n"
+        "--busy-poll usec                 set SO_BUSY_POLL on player sockets\n"
+        "--shards n                       run n event loops with SO_REUSEPORT listeners\n"
+        "--cpus list                      pin shards to the comma separated list of cpus\n"
+        "--incoming-cpu                   steer connections to the shard pinned to the RX queue cpu\n"
+        "--steal                          let idle shards take games from busy ones\n"
+        "--stats sec                      log shard statistics every sec seconds\n"
+        "--profile                        start with profiling on, SIGUSR1 toggles it\n"
+        "--stall ms                       log event loop iterations longer than ms, default 5, 0 - disabled\n"
+        "--control port                   accept trace commands on 127.0.0.1:port\n"
+        "--quantum bytes                  bytes a player reads, routes and writes per loop iteration, default 16384,\n"
+        "                                 0 - no limit\n"
+        "--codel ms                       drop MP_DAT frames queued to a player longer than ms, default 25,\n"
+        "                                 0 - never\n"
+        "--notsent-lowat bytes            TCP_NOTSENT_LOWAT of player sockets, default 16384, 0 - kernel default\n"
+        "--lanes off|size|mp              send lanes by frame size, mp - also MP_ACK/MP_KPA first, default mp\n"
+        "--lane-weights c,s,b             weights of the control, small and bulk lanes, default strict priority\n"
+        "--kpa-offload sec                answer MP_KPA of idle teammates on the same shard with a synthesized\n"
+        "                                 MP_ACK, let one through every sec seconds\n",
         prog);
     exit(EXIT_FAILURE);
 }
@@ -131,6 +2807,11 @@ main(int argc, char *argv[])
     //mg_log_set(MG_LL_DEBUG);
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, signal_handler);
+    if (sizeof(struct ConState) > MG_DATA_SIZE) {
+        MG_ERROR(("sizeof ConState == %u, MG_DATA_SIZE is %u", sizeof(struct ConState), MG_DATA_SIZE));
+        exit(EXIT_FAILURE);
+    }
     if (sizeof(struct ProxyHeader) != PROXY_HEADER_LEN) {
         MG_ERROR(("sizeof PacketHeader == %u, expected %u, check compiler options",
             sizeof(struct ProxyHeader), PROXY_HEADER_LEN));
@@ -139,19 +2820,87 @@ main(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         if (mg_casecmp("--port", argv[i]) == 0) {
             s_port = argv[++i];
+        } else if (mg_casecmp("--spin", argv[i]) == 0) {
+            s_spin_idle = atoi(argv[++i]);
+        } else if (mg_casecmp("--busy-poll", argv[i]) == 0) {
+            s_busy_poll = atoi(argv[++i]);
+        } else if (mg_casecmp("--shards", argv[i]) == 0) {
+            s_num_shards = atoi(argv[++i]);
+        } else if (mg_casecmp("--cpus", argv[i]) == 0) {
+            if (parse_cpus(argv[++i]) < 0)
+                usage(argv[0]);
+        } else if (mg_casecmp("--incoming-cpu", argv[i]) == 0) {
+            s_incoming_cpu = 1;
+        } else if (mg_casecmp("--steal", argv[i]) == 0) {
+            s_steal = 1;
+        } else if (mg_casecmp("--profile", argv[i]) == 0) {
+            s_profile = 1;
+        } else if (mg_casecmp("--stall", argv[i]) == 0) {
+            s_stall = (uint64_t)atoi(argv[++i]) * 1000000;
+        } else if (mg_casecmp("--quantum", argv[i]) == 0) {
+            s_quantum = (uint32_t)atoi(argv[++i]);
+        } else if (mg_casecmp("--codel", argv[i]) == 0) {
+            s_codel_target = (uint64_t)atoi(argv[++i]) * 1000000;
+        } else if (mg_casecmp("--notsent-lowat", argv[i]) == 0) {
+            s_notsent_lowat = atoi(argv[++i]);
+        } else if (mg_casecmp("--lanes", argv[i]) == 0) {
+            if (parse_lanes(argv[++i]) < 0)
+                usage(argv[0]);
+        } else if (mg_casecmp("--lane-weights", argv[i]) == 0) {
+            if (parse_lane_weights(argv[++i]) < 0)
+                usage(argv[0]);
+        } else if (mg_casecmp("--kpa-offload", argv[i]) == 0) {
+            s_kpa_offload = (uint32_t)atoi(argv[++i]) * 1000;
+        } else if (mg_casecmp("--control", argv[i]) == 0) {
+            s_control_port = argv[++i];
+        } else if (mg_casecmp("--stats", argv[i]) == 0) {
+            s_stats_interval = atoi(argv[++i]);
         } else if (mg_casecmp("--help", argv[i]) == 0) {
             usage(argv[0]);
         }
     }
-    vt_init(&s_players);
-    struct mg_mgr mgr;
-    mg_mgr_init(&mgr);
-    char url[100];
-    mg_snprintf(url, sizeof(url), "tcp://0.0.0.0:%s", s_port);
-    mg_listen(&mgr, url, proxy_fn, NULL);
-    while (s_signo == 0) {
-        mg_mgr_poll(&mgr, 5);
+    if (s_num_shards < 1 || s_num_shards > MAX_SHARDS)
+        usage(argv[0]);
+#if !defined(__linux__)
+    if (s_num_shards > 1) {
+        MG_ERROR(("--shards requires SO_REUSEPORT, only Linux is supported"));
+        exit(EXIT_FAILURE);
+    }
+#endif
+    if (!tsc_init())
+        MG_INFO(("no invariant TSC, timestamps come from clock_gettime()"));
+    // the shards dump traces in parallel, pick the hex encoder before they start
+    hex_init();
+    vt_init(&s_directory);
+    vt_init(&s_games);
+    s_base_rss = process_rss();
+    for (int i = 0; i < s_num_shards; ++i) {
+        struct Shard *shard = &s_shards[i];
+        shard->id = i;
+        shard->cpu = s_num_cpus ? s_cpus[i % s_num_cpus] : -1;
+    }
+    // the first shard runs in the main thread
+    for (int i = 1; i < s_num_shards; ++i) {
+        if (pthread_create(&s_shards[i].thread, NULL, shard_loop, &s_shards[i]) != 0) {
+            MG_ERROR(("can't start shard=%d", i));
+            exit(EXIT_FAILURE);
+        }
+    }
+    shard_loop(&s_shards[0]);
+    for (int i = 1; i < s_num_shards; ++i)
+        pthread_join(s_shards[i].thread, NULL);
+    // free after every loop is stopped, shards may still wake up each other
+    for (int i = 0; i < s_num_shards; ++i) {
+        mg_mgr_free(&s_shards[i].mgr);
+        iopool_free(&s_shards[i].iopool);
+        connpool_free_all(&s_shards[i].connpool);
+        arena_pool_free(&s_shards[i].arenas);
+        free(s_shards[i].trace_ring);
+        free(s_shards[i].ready);
+        queue_free(&s_shards[i].queue);
+        vt_cleanup(&s_shards[i].players);
     }
-    mg_mgr_free(&mgr);
+    vt_cleanup(&s_directory);
+    vt_cleanup(&s_games);
     return 0;
 }
@@ -302,7 +302,7 @@ bool mg_flash_load(void *sector, uint32_t key, void *buf, size_t len) {
 static void mg_flash_sector_cleanup(char *sector) {
   // Buffer all saved objects into an IO buffer (backed by RAM)
   // erase sector, and re-save them.
-  struct mg_iobuf io = {0, 0, 0, 2048};
+  struct mg_iobuf io = {0, 0, 0, 2048, NULL};
   size_t ss = mg_flash_sector_size();
   size_t n, size, size2, ofs = 0, hs = sizeof(uint32_t) * 2;
   uint32_t key;
@@ -3362,9 +3362,23 @@ int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   new_size = roundup(new_size, io->align);
   if (new_size == 0) {
     mg_bzero(io->buf, io->size);
-    free(io->buf);
+    if (io->allocator != NULL) {
+      if (io->buf != NULL) io->allocator->resize(io->allocator->ctx, io->buf, 0, 0);
+    } else {
+      free(io->buf);
+    }
     io->buf = NULL;
     io->len = io->size = 0;
+  } else if (new_size != io->size && io->allocator != NULL) {
+    size_t len = new_size < io->len ? new_size : io->len;
+    void *p = io->allocator->resize(io->allocator->ctx, io->buf, len, new_size);
+    if (p != NULL) {
+      io->buf = (unsigned char *) p;
+      io->size = new_size;
+    } else {
+      ok = 0;
+      MG_ERROR(("%lld->%lld", (uint64_t) io->size, (uint64_t) new_size));
+    }
   } else if (new_size != io->size) {
     // NOTE(lsm): do not use realloc here. Use calloc/free only, to ease the
     // porting to some obscure platforms like FreeRTOS
@@ -3386,6 +3400,7 @@ int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
 
 int mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align) {
   io->buf = NULL;
+  io->allocator = NULL;
   io->align = align;
   io->size = io->len = 0;
   return mg_iobuf_resize(io, size);
@@ -4744,12 +4759,26 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
          mg_aton6(str, addr);
 }
 
+static void mg_free_conn(struct mg_mgr *mgr, struct mg_connection *c) {
+  if (mgr->conn_allocator != NULL) {
+    mgr->conn_allocator->free(mgr->conn_allocator->ctx, c);
+  } else {
+    free(c);
+  }
+}
+
 struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
+  size_t size = sizeof(struct mg_connection) + mgr->extraconnsize;
   struct mg_connection *c =
-      (struct mg_connection *) calloc(1, sizeof(*c) + mgr->extraconnsize);
+      mgr->conn_allocator != NULL
+          ? (struct mg_connection *) mgr->conn_allocator->alloc(
+                mgr->conn_allocator->ctx, size)
+          : (struct mg_connection *) calloc(1, size);
   if (c != NULL) {
     c->mgr = mgr;
     c->send.align = c->recv.align = c->rtls.align = MG_IO_SIZE;
+    c->send.allocator = c->recv.allocator = c->rtls.allocator =
+        mgr->iobuf_allocator;
     c->id = ++mgr->nextid;
     MG_PROF_INIT(c);
   }
@@ -4757,6 +4786,7 @@ struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
 }
 
 void mg_close_conn(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
   mg_resolve_cancel(c);  // Close any pending DNS query
   LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
   if (c == c->mgr->dns4.c) c->mgr->dns4.c = NULL;
@@ -4773,7 +4803,7 @@ void mg_close_conn(struct mg_connection *c) {
   mg_iobuf_free(&c->send);
   mg_iobuf_free(&c->rtls);
   mg_bzero((unsigned char *) c, sizeof(*c));
-  free(c);
+  mg_free_conn(mgr, c);
 }
 
 struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
@@ -4805,7 +4835,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
   } else if (!mg_open_listener(c, url)) {
     MG_ERROR(("Failed: %s, errno %d", url, errno));
     MG_PROF_FREE(c);
-    free(c);
+    mg_free_conn(mgr, c);
     c = NULL;
   } else {
     c->is_listening = 1;
@@ -6395,7 +6425,7 @@ void mg_pfn_iobuf(char ch, void *param) {
 }
 
 size_t mg_vsnprintf(char *buf, size_t len, const char *fmt, va_list *ap) {
-  struct mg_iobuf io = {(uint8_t *) buf, len, 0, 0};
+  struct mg_iobuf io = {(uint8_t *) buf, len, 0, 0, NULL};
   size_t n = mg_vxprintf(mg_putchar_iobuf_static, &io, fmt, ap);
   if (n < len) buf[n] = '\0';
   return n;
@@ -6411,7 +6441,7 @@ size_t mg_snprintf(char *buf, size_t len, const char *fmt, ...) {
 }
 
 char *mg_vmprintf(const char *fmt, va_list *ap) {
-  struct mg_iobuf io = {0, 0, 0, 256};
+  struct mg_iobuf io = {0, 0, 0, 256, NULL};
   mg_vxprintf(mg_pfn_iobuf, &io, fmt, ap);
   return (char *) io.buf;
 }
@@ -7477,6 +7507,7 @@ static void read_conn(struct mg_connection *c) {
     char *buf = (char *) &c->recv.buf[c->recv.len];
     size_t len = c->recv.size - c->recv.len;
     long n = -1;
+    if (c->mgr->io_budget > 0 && len > c->mgr->io_budget) len = c->mgr->io_budget;
     if (c->is_tls) {
       if (!ioalloc(c, &c->rtls)) return;
       n = recv_raw(c, (char *) &c->rtls.buf[c->rtls.len],
@@ -7501,6 +7532,7 @@ static void read_conn(struct mg_connection *c) {
 static void write_conn(struct mg_connection *c) {
   char *buf = (char *) c->send.buf;
   size_t len = c->send.len;
+  if (c->mgr->io_budget > 0 && len > c->mgr->io_budget) len = c->mgr->io_budget;
   long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
   MG_DEBUG(("%lu %ld snd %ld/%ld rcv %ld/%ld n=%ld err=%d", c->id, c->fd,
             (long) c->send.len, (long) c->send.size, (long) c->recv.len,
@@ -7935,7 +7967,7 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
 
 #if MG_ENABLE_SSI
 static char *mg_ssi(const char *path, const char *root, int depth) {
-  struct mg_iobuf b = {NULL, 0, 0, MG_IO_SIZE};
+  struct mg_iobuf b = {NULL, 0, 0, MG_IO_SIZE, NULL};
   FILE *fp = fopen(path, "rb");
   if (fp != NULL) {
     char buf[MG_SSI_BUFSIZ], arg[sizeof(buf)];
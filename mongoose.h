@@ -1134,11 +1134,20 @@ const char *mg_url_uri(const char *url);
 
 
 
+// Pluggable iobuf memory, see mg_mgr::iobuf_allocator. resize() works like
+// realloc(): keeps the first `len` bytes, frees the block if new_size is 0.
+// The returned memory doesn't have to be zeroed.
+struct mg_iobuf_allocator {
+  void *(*resize)(void *ctx, void *buf, size_t len, size_t new_size);
+  void *ctx;
+};
+
 struct mg_iobuf {
   unsigned char *buf;  // Pointer to stored data
   size_t size;         // Total size available
   size_t len;          // Current number of bytes
   size_t align;        // Alignment during allocation
+  struct mg_iobuf_allocator *allocator;  // NULL - use calloc/free
 };
 
 int mg_iobuf_init(struct mg_iobuf *, size_t, size_t);
@@ -1987,6 +1996,13 @@ struct mg_addr {
   bool is_ip6;       // True when address is IPv6 address
 };
 
+// Pluggable struct mg_connection memory, alloc() must return zeroed memory
+struct mg_conn_allocator {
+  void *(*alloc)(void *ctx, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
+};
+
 struct mg_mgr {
   struct mg_connection *conns;  // List of active connections
   struct mg_dns dns4;           // DNS for IPv4
@@ -2004,6 +2020,9 @@ struct mg_mgr {
   void *priv;                   // Used by the MIP stack
   size_t extraconnsize;         // Used by the MIP stack
   MG_SOCKET_TYPE pipe;          // Socketpair end for mg_wakeup()
+  struct mg_iobuf_allocator *iobuf_allocator;  // Connection iobufs memory
+  struct mg_conn_allocator *conn_allocator;    // struct mg_connection memory
+  size_t io_budget;  // Max bytes a connection reads or writes per poll, 0 - any
 #if MG_ENABLE_FREERTOS_TCP
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
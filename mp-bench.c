@@ -0,0 +1,582 @@
+// Simulated games behind gpgnet-mock, measures what the game sees of the
+// relay leg: resends and the delay of the sim data.
+//
+// Every game connects to the GPGNet port like ForgedAlliance.exe, opens the
+// lobby port it is told to and sends MP_DAT to every peer each --beat ms.
+// The reliable layer is a model of the game one: at most --window MP_DAT
+// in flight per peer (the beats wait and go out together when it is full),
+// a resend after --resend ms without an ack, the ack is delayed up to
+// --ack-delay ms unless the game's own MP_DAT carries `expected` sooner.
+// The sim lag is the time from a beat to its in order delivery to the peer.
+//
+// With --deflate the MP_DAT payload is what the game sends: a deflate stream
+// per peer of MPMsg, the sim tick messages of every beat and the beat time
+// for the lag, decoded on the other side by mpmsg.h.
+#include "mongoose.h"
+#include "tsc.h"
+#include "mpmsg.h"
+#include <signal.h>
+
+#define MP_DAT 4
+#define MP_ACK 5
+
+#define MAX_PEERS 16
+#define MAX_BEATS 64        // beats per MP_DAT
+#define MAX_INFLIGHT 64
+#define REORDER_SLOTS 64
+#define MAX_PAYLOAD 1400    // --deflate
+#define DEFLATE_BEATS 32    // beats per compressed MP_DAT, they fit MAX_PAYLOAD
+#define MSG_BEAT 0xf0       // mp-bench only, u64 beat time
+
+struct MPHeader {
+    uint8_t type;
+    uint32_t mask;
+    uint16_t ser;
+    uint16_t irt;
+    uint16_t seq;
+    uint16_t expected;
+    uint16_t len;
+    uint8_t data[0];
+} __attribute__((packed));
+
+// MP_DAT payload
+struct BeatBatch {
+    uint8_t count;
+    uint64_t time[MAX_BEATS];   // ns, beat time
+} __attribute__((packed));
+
+struct Inflight {
+    uint16_t seq;
+    uint8_t count;
+    uint64_t sent;              // ms, the last (re)send
+    uint64_t time[MAX_BEATS];
+    uint16_t len;               // --deflate, a resend repeats the bytes
+    uint8_t payload[MAX_PAYLOAD];
+};
+
+struct Peer {
+    uint32_t id;
+    uint16_t port;              // the proxy port gpgnet-mock gave for the peer
+    uint16_t ser;
+    uint16_t next_seq;
+    uint16_t expected;          // the next MP_DAT seq of the peer
+    uint16_t ack_irt;
+    uint64_t ack_due;           // ms, 0 - nothing to ack
+    uint64_t pending[MAX_BEATS];    // beats waiting for the window
+    int num_pending;
+    struct Inflight inflight[MAX_INFLIGHT];
+    int num_inflight;
+    struct BeatBatch reorder[REORDER_SLOTS];    // by seq
+    bool have[REORDER_SLOTS];
+    // --deflate
+    z_stream out;
+    bool out_init;
+    uint32_t tick;              // sim ticks sent
+    struct MPStream in;
+};
+
+struct Game {
+    int index;
+    struct mg_connection *gpgnet;
+    struct mg_connection *udp;
+    struct Peer peers[MAX_PEERS];
+    int num_peers;
+    uint64_t next_beat;
+};
+
+struct Samples {
+    uint64_t *items;
+    size_t len;
+    size_t cap;
+};
+
+static int s_signo;
+static struct Game s_games[MAX_PEERS];
+static struct Samples s_lag;
+static uint64_t s_dat_sent;
+static uint64_t s_resends;
+static uint64_t s_acks_sent;
+static uint64_t s_window_full;  // beats that waited for the window
+static bool s_running;
+// command line arguments
+static const char *s_url = "tcp://127.0.0.1:7237";
+static int s_players = 2;
+static int s_duration = 10;     // seconds
+static int s_beat = 25;         // ms, net_SendDelay
+static int s_ack_delay = 25;    // ms, net_AckDelay
+static int s_resend = 100;      // ms, net_MinResendDelay
+static int s_window = 4;
+static int s_size = 64;         // MP_DAT payload bytes at least
+static bool s_deflate;
+static int s_slow_beat = 0;     // ms, the beat of the last game, 0 - --beat
+static uint64_t s_messages;
+
+static void
+signal_handler(int signo)
+{
+    s_signo = signo;
+}
+
+static void
+samples_add(struct Samples *s, uint64_t v)
+{
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->items = realloc(s->items, s->cap * sizeof(s->items[0]));
+        if (!s->items) {
+            MG_ERROR(("OOM"));
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->items[s->len++] = v;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile_ms(struct Samples *s, double p)
+{
+    if (!s->len)
+        return 0;
+    size_t i = (size_t)(p * (double)(s->len - 1));
+    return (double)s->items[i] / 1e6;
+}
+
+// GPGNet strings and tagged arguments, see gpgnet-mock.c
+static void
+send_u32(struct mg_connection *c, uint32_t u)
+{
+    uint8_t buf[4] = { (uint8_t)u, (uint8_t)(u >> 8), (uint8_t)(u >> 16), (uint8_t)(u >> 24) };
+    mg_send(c, buf, sizeof(buf));
+}
+
+static void
+send_str(struct mg_connection *c, const char *s)
+{
+    send_u32(c, (uint32_t)strlen(s));
+    mg_send(c, s, strlen(s));
+}
+
+static void
+send_game_state(struct mg_connection *c, const char *state)
+{
+    send_str(c, "GameState");
+    send_u32(c, 1);
+    mg_send(c, "\x01", 1);
+    send_str(c, state);
+}
+
+static uint32_t
+read_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+send_mp(struct Game *g, struct Peer *p, struct MPHeader *h, size_t len)
+{
+    h->ser = ++p->ser;
+    h->expected = p->expected;
+    g->udp->rem.port = mg_htons(p->port);
+    mg_send(g->udp, h, len);
+    // `expected` acks whatever the peer sent so far
+    p->ack_due = 0;
+}
+
+static void
+send_dat(struct Game *g, struct Peer *p, struct Inflight *f, uint64_t now)
+{
+    uint8_t buf[sizeof(struct MPHeader) + sizeof(struct BeatBatch) + 1500];
+    struct MPHeader *h = (struct MPHeader *)buf;
+    if (s_deflate) {
+        *h = (struct MPHeader){ .type = MP_DAT, .seq = f->seq, .len = f->len };
+        memcpy(h->data, f->payload, f->len);
+        send_mp(g, p, h, sizeof(struct MPHeader) + f->len);
+        f->sent = now;
+        s_dat_sent++;
+        return;
+    }
+    struct BeatBatch *b = (struct BeatBatch *)h->data;
+    size_t len = 1 + f->count * sizeof(uint64_t);
+    if (len < (size_t)s_size)
+        len = (size_t)s_size;
+    memset(buf, 0, sizeof(struct MPHeader) + len);
+    h->type = MP_DAT;
+    h->seq = f->seq;
+    h->len = (uint16_t)len;
+    b->count = f->count;
+    memcpy(b->time, f->time, f->count * sizeof(uint64_t));
+    send_mp(g, p, h, sizeof(struct MPHeader) + len);
+    f->sent = now;
+    s_dat_sent++;
+}
+
+static uint8_t *
+put_msg(uint8_t *p, uint8_t type, const void *data, size_t len)
+{
+    p[0] = type;
+    p[1] = (uint8_t)(len + 3);
+    p[2] = (uint8_t)((len + 3) >> 8);
+    memcpy(p + 3, data, len);
+    return p + 3 + len;
+}
+
+// the messages of the beats compressed into the MP_DAT payload, once
+static bool
+deflate_beats(struct Peer *p, struct Inflight *f)
+{
+    uint8_t msgs[DEFLATE_BEATS * 64], *m = msgs;
+    if (!p->out_init) {
+        if (deflateInit2(&p->out, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MPS_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        p->out_init = true;
+    }
+    for (int i = 0; i < f->count; ++i) {
+        uint32_t tick = ++p->tick, one = 1;
+        uint8_t beat[5] = { 0, (uint8_t)tick, (uint8_t)(tick >> 8), (uint8_t)(tick >> 16), (uint8_t)(tick >> 24) };
+        // the idle sim of the game, see README
+        m = put_msg(m, 0x32, beat, sizeof(beat));
+        m = put_msg(m, 0x00, &one, 4);
+        m = put_msg(m, 0x34, beat + 1, 4);
+        m = put_msg(m, 0x33, beat + 1, 4);
+        m = put_msg(m, MSG_BEAT, &f->time[i], 8);
+    }
+    p->out.next_in = msgs;
+    p->out.avail_in = (uInt)(m - msgs);
+    p->out.next_out = f->payload;
+    p->out.avail_out = sizeof(f->payload);
+    if (deflate(&p->out, Z_SYNC_FLUSH) != Z_OK || p->out.avail_in || !p->out.avail_out)
+        return false;
+    f->len = (uint16_t)(sizeof(f->payload) - p->out.avail_out);
+    return true;
+}
+
+static void
+flush_pending(struct Game *g, struct Peer *p, uint64_t now)
+{
+    if (!p->num_pending || p->num_inflight >= s_window || p->num_inflight == MAX_INFLIGHT)
+        return;
+    struct Inflight *f = &p->inflight[p->num_inflight++];
+    int count = s_deflate && p->num_pending > DEFLATE_BEATS ? DEFLATE_BEATS : p->num_pending;
+    f->seq = p->next_seq++;
+    f->count = (uint8_t)count;
+    memcpy(f->time, p->pending, (size_t)count * sizeof(uint64_t));
+    p->num_pending -= count;
+    memmove(p->pending, p->pending + count, (size_t)p->num_pending * sizeof(uint64_t));
+    if (s_deflate && !deflate_beats(p, f)) {
+        MG_ERROR(("game %d: deflate failed", g->index));
+        s_signo = SIGTERM;
+        return;
+    }
+    send_dat(g, p, f, now);
+}
+
+static void
+handle_acked(struct Peer *p, uint16_t expected)
+{
+    int n = 0;
+    for (int i = 0; i < p->num_inflight; ++i) {
+        if ((int16_t)(p->inflight[i].seq - expected) >= 0)
+            p->inflight[n++] = p->inflight[i];
+    }
+    p->num_inflight = n;
+}
+
+static void
+deliver(struct Peer *p, struct BeatBatch *b)
+{
+    uint64_t now = tsc_ns();
+    for (int i = 0; i < b->count && i < MAX_BEATS; ++i) {
+        if (s_running)
+            samples_add(&s_lag, now - b->time[i]);
+    }
+    p->expected++;
+}
+
+static void
+on_message(void *arg, uint8_t type, const uint8_t *data, size_t len)
+{
+    (void)arg;
+    s_messages++;
+    uint64_t time;
+    if (type == MSG_BEAT && len == sizeof(time) && s_running) {
+        memcpy(&time, data, sizeof(time));
+        samples_add(&s_lag, tsc_ns() - time);
+    }
+}
+
+static void
+handle_mp(struct Game *g, struct Peer *p, struct MPHeader *h, size_t len)
+{
+    handle_acked(p, h->expected);
+    if (h->type != MP_DAT || len < sizeof(*h) + 1)
+        return;
+    if (s_deflate) {
+        size_t n = len - sizeof(*h) < h->len ? len - sizeof(*h) : h->len;
+        if (!mps_packet(&p->in, h->seq, h->data, n, on_message, p)) {
+            MG_ERROR(("game %d: the MP_DAT seq=%u doesn't decode", g->index, h->seq));
+            s_signo = SIGTERM;
+        }
+        p->expected = p->in.next;
+        p->ack_irt = h->ser;
+        if (!p->ack_due)
+            p->ack_due = mg_millis() + (uint64_t)s_ack_delay;
+        return;
+    }
+    struct BeatBatch *b = (struct BeatBatch *)h->data;
+    int16_t ahead = (int16_t)(h->seq - p->expected);
+    if (ahead >= 0 && ahead < REORDER_SLOTS) {
+        struct BeatBatch *slot = &p->reorder[h->seq % REORDER_SLOTS];
+        size_t n = len - sizeof(*h);
+        memcpy(slot, b, n < sizeof(*slot) ? n : sizeof(*slot));
+        p->have[h->seq % REORDER_SLOTS] = true;
+        while (p->have[p->expected % REORDER_SLOTS]) {
+            p->have[p->expected % REORDER_SLOTS] = false;
+            deliver(p, &p->reorder[p->expected % REORDER_SLOTS]);
+        }
+    }
+    // a duplicate is acked again
+    p->ack_irt = h->ser;
+    if (!p->ack_due)
+        p->ack_due = mg_millis() + (uint64_t)s_ack_delay;
+    (void)g;
+}
+
+static void
+game_poll(struct Game *g, uint64_t now)
+{
+    bool beat = s_running && now >= g->next_beat;
+    if (beat)
+        g->next_beat = now + (uint64_t)(s_slow_beat && g->index == s_players - 1 ? s_slow_beat : s_beat);
+    for (int i = 0; i < g->num_peers; ++i) {
+        struct Peer *p = &g->peers[i];
+        if (beat && p->num_pending < MAX_BEATS) {
+            p->pending[p->num_pending++] = tsc_ns();
+            if (p->num_inflight >= s_window)
+                s_window_full++;
+            flush_pending(g, p, now);
+        }
+        for (int k = 0; k < p->num_inflight; ++k) {
+            if (now - p->inflight[k].sent >= (uint64_t)s_resend) {
+                s_resends++;
+                send_dat(g, p, &p->inflight[k], now);
+            }
+        }
+        if (p->ack_due && now >= p->ack_due) {
+            struct MPHeader ack = { .type = MP_ACK, .irt = p->ack_irt, .seq = p->next_seq };
+            send_mp(g, p, &ack, sizeof(ack));
+            s_acks_sent++;
+        }
+        flush_pending(g, p, now);
+    }
+}
+
+static void
+udp_fn(struct mg_connection *c, int ev, void *ev_data)
+{
+    struct Game *g = (struct Game *)c->fn_data;
+    if (ev == MG_EV_READ) {
+        uint16_t port = mg_ntohs(c->rem.port);
+        for (int i = 0; i < g->num_peers; ++i) {
+            if (g->peers[i].port == port && c->recv.len >= sizeof(struct MPHeader))
+                handle_mp(g, &g->peers[i], (struct MPHeader *)c->recv.buf, c->recv.len);
+        }
+        c->recv.len = 0;
+    }
+    (void)ev_data;
+}
+
+static void
+add_peer(struct Game *g, struct mg_str url, uint32_t id)
+{
+    struct mg_str host, port;
+    uint16_t n = 0;
+    if (!mg_span(url, &host, &port, ':') || !mg_str_to_num(port, 10, &n, sizeof(n)))
+        return;
+    for (int i = 0; i < g->num_peers; ++i) {
+        if (g->peers[i].id == id)
+            return;
+    }
+    if (g->num_peers == MAX_PEERS)
+        return;
+    g->peers[g->num_peers++] = (struct Peer){ .id = id, .port = n, .next_seq = 1, .expected = 1 };
+}
+
+// returns false until the whole command is in recv
+static bool
+handle_command(struct Game *g, struct mg_connection *c, size_t *used)
+{
+    const uint8_t *p = c->recv.buf, *end = p + c->recv.len;
+    struct mg_str name, params[8] = { 0 };
+    uint32_t nums[8] = { 0 };
+    if (end - p < 4 || (size_t)(end - p - 4) < read_u32(p))
+        return false;
+    name = mg_str_n((const char *)p + 4, read_u32(p));
+    p += 4 + name.len;
+    if (end - p < 4)
+        return false;
+    uint32_t n = read_u32(p);
+    p += 4;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (end - p < 5)
+            return false;
+        uint8_t tag = p[0];
+        uint32_t v = read_u32(p + 1);
+        p += 5;
+        if (tag) {
+            if ((size_t)(end - p) < v)
+                return false;
+            if (i < 8)
+                params[i] = mg_str_n((const char *)p, v);
+            p += v;
+        } else if (i < 8) {
+            nums[i] = v;
+        }
+    }
+    *used = (size_t)(p - c->recv.buf);
+    if (mg_strcmp(name, mg_str("CreateLobby")) == 0) {
+        char url[64];
+        mg_snprintf(url, sizeof(url), "udp://127.0.0.1:%u", nums[1]);
+        if ((g->udp = mg_listen(c->mgr, url, udp_fn, g)) == NULL) {
+            MG_ERROR(("game %d: can't listen on %s", g->index, url));
+            s_signo = SIGTERM;
+            return true;
+        }
+        send_game_state(c, "Lobby");
+    } else if (mg_strcmp(name, mg_str("JoinGame")) == 0 || mg_strcmp(name, mg_str("ConnectToPeer")) == 0) {
+        add_peer(g, params[0], nums[2]);
+    }
+    return true;
+}
+
+static void
+gpgnet_fn(struct mg_connection *c, int ev, void *ev_data)
+{
+    struct Game *g = (struct Game *)c->fn_data;
+    if (ev == MG_EV_CONNECT) {
+        send_game_state(c, "Idle");
+    } else if (ev == MG_EV_ERROR) {
+        MG_ERROR(("game %d: %s", g->index, (char *)ev_data));
+        s_signo = SIGTERM;
+    } else if (ev == MG_EV_READ) {
+        size_t used;
+        while (handle_command(g, c, &used))
+            mg_iobuf_del(&c->recv, 0, used);
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "%s usage:\n"
+        "--help                           show help message\n"
+        "--url arg                        gpgnet-mock url, default tcp://127.0.0.1:7237\n"
+        "--players n                      number of games, default 2, at most gpgnet-mock --players\n"
+        "--duration sec                   test duration, default 10\n"
+        "--beat ms                        MP_DAT interval, default 25\n"
+        "--ack-delay ms                   how long the game holds an MP_ACK, default 25\n"
+        "--resend ms                      resend MP_DAT not acked for ms, default 100\n"
+        "--window n                       MP_DAT in flight per peer, default 4\n"
+        "--size n                         MP_DAT payload size, default 64\n"
+        "--deflate                        the payload is a deflate stream of MPMsg like the game sends\n"
+        "--slow-beat ms                   the beat of the last game, it falls behind the others\n",
+        prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    mg_log_set(MG_LL_INFO);
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    for (int i = 1; i < argc; i++) {
+        if (mg_casecmp("--url", argv[i]) == 0 && i + 1 < argc) {
+            s_url = argv[++i];
+        } else if (mg_casecmp("--players", argv[i]) == 0 && i + 1 < argc) {
+            s_players = atoi(argv[++i]);
+        } else if (mg_casecmp("--duration", argv[i]) == 0 && i + 1 < argc) {
+            s_duration = atoi(argv[++i]);
+        } else if (mg_casecmp("--beat", argv[i]) == 0 && i + 1 < argc) {
+            s_beat = atoi(argv[++i]);
+        } else if (mg_casecmp("--ack-delay", argv[i]) == 0 && i + 1 < argc) {
+            s_ack_delay = atoi(argv[++i]);
+        } else if (mg_casecmp("--resend", argv[i]) == 0 && i + 1 < argc) {
+            s_resend = atoi(argv[++i]);
+        } else if (mg_casecmp("--window", argv[i]) == 0 && i + 1 < argc) {
+            s_window = atoi(argv[++i]);
+        } else if (mg_casecmp("--size", argv[i]) == 0 && i + 1 < argc) {
+            s_size = atoi(argv[++i]);
+        } else if (mg_casecmp("--deflate", argv[i]) == 0) {
+            s_deflate = true;
+        } else if (mg_casecmp("--slow-beat", argv[i]) == 0 && i + 1 < argc) {
+            s_slow_beat = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (s_players < 2 || s_players > MAX_PEERS || s_duration <= 0 || s_beat <= 0 || s_ack_delay < 0 ||
+        s_resend <= 0 || s_window <= 0 || s_window > MAX_INFLIGHT || s_size < 0 || s_size > 1400 || s_slow_beat < 0)
+        usage(argv[0]);
+    tsc_init();
+    struct mg_mgr mgr;
+    mg_mgr_init(&mgr);
+    for (int i = 0; i < s_players; ++i)
+        s_games[i].index = i;
+    uint64_t start = 0, stop = 0;
+    while (s_signo == 0 && (!stop || mg_millis() < stop)) {
+        mg_mgr_poll(&mgr, 1);
+        uint64_t now = mg_millis();
+        // one at a time, gpgnet-mock gives the slots in the order of connections
+        int connected = 0;
+        while (connected < s_players && s_games[connected].udp)
+            connected++;
+        if (connected < s_players && !s_games[connected].gpgnet && (connected == 0 || s_games[connected - 1].udp))
+            s_games[connected].gpgnet = mg_connect(&mgr, s_url, gpgnet_fn, &s_games[connected]);
+        // everybody knows everybody
+        int links = 0;
+        for (int i = 0; i < s_players; ++i)
+            links += s_games[i].num_peers;
+        if (!s_running && links == s_players * (s_players - 1)) {
+            s_running = true;
+            start = now;
+            stop = now + (uint64_t)s_duration * 1000;
+        }
+        for (int i = 0; i < s_players; ++i)
+            if (s_games[i].udp)
+                game_poll(&s_games[i], now);
+    }
+    if (!s_running) {
+        MG_ERROR(("the games didn't connect, is gpgnet-mock running with --players %d?", s_players));
+        return EXIT_FAILURE;
+    }
+    qsort(s_lag.items, s_lag.len, sizeof(s_lag.items[0]), cmp_u64);
+    double secs = (double)(mg_millis() - start) / 1000.0;
+    printf("players=%d beat=%dms ack-delay=%dms resend=%dms window=%d\n",
+        s_players, s_beat, s_ack_delay, s_resend, s_window);
+    printf("dat/s=%.1f resends/s=%.1f acks/s=%.1f beats waited for the window=%llu\n",
+        (double)s_dat_sent / secs, (double)s_resends / secs, (double)s_acks_sent / secs,
+        (unsigned long long)s_window_full);
+    printf("sim lag ms: p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+        percentile_ms(&s_lag, 0.5), percentile_ms(&s_lag, 0.9),
+        percentile_ms(&s_lag, 0.99), percentile_ms(&s_lag, 1.0));
+    if (s_deflate)
+        printf("messages/s=%.1f\n", (double)s_messages / secs);
+    for (int i = 0; i < s_players; ++i) {
+        for (int k = 0; k < s_games[i].num_peers; ++k) {
+            struct Peer *p = &s_games[i].peers[k];
+            if (p->out_init)
+                deflateEnd(&p->out);
+            mps_free(&p->in);
+        }
+    }
+    mg_mgr_free(&mgr);
+    free(s_lag.items);
+    return 0;
+}
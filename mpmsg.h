@@ -0,0 +1,171 @@
+// The messages inside MP_DAT: every direction between two games is one
+// raw deflate stream (windowBits -14) of
+//
+//   struct MPMsg { u8 type; u16 len; u8 data[len - 3]; }
+//
+// cut into MP_DAT at arbitrary points, a message may span packets. The
+// decoder of a direction inflates the payloads in seq order: a resend is
+// dropped, a packet ahead of the next seq waits for the gap to fill.
+//
+//   mps_packet(s, seq, data, len, fn, arg)   fn(arg, type, data, len) per message
+//   mps_free(s)
+//
+// A stream that fails to inflate or holds a message shorter than its own
+// header is out of sync for good, `broken` is set and the rest is ignored.
+// So is one with a packet MPS_REORDER or more ahead of the next seq: the gap
+// is not going to fill (the capture started mid-stream, or lost packets the
+// games resent long ago) and the inflate state cannot skip it.
+#ifndef MPMSG_H
+#define MPMSG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define MPS_WBITS -14
+#define MPS_REORDER 64                  // packets held ahead of a gap
+#define MPS_MSG_HEADER 3
+#define MPS_BUFFER (65536 + 4096)       // the longest message and some output
+
+typedef void (*mps_fn)(void *arg, uint8_t type, const uint8_t *data, size_t len);
+
+struct MPStream {
+    z_stream z;
+    bool init;              // z is set up
+    bool started;           // `next` is known
+    bool broken;
+    uint16_t next;          // seq of the next MP_DAT to inflate
+    uint8_t *ahead[MPS_REORDER];    // copies of the packets after a gap, by seq
+    uint16_t ahead_len[MPS_REORDER];
+    uint8_t *buf;           // inflated, the start of an incomplete message
+    size_t buf_len;
+    // counters
+    uint64_t packets;
+    uint64_t resends;       // seq before `next`
+    uint64_t reordered;     // waited for a gap
+    uint64_t overflow;      // too far ahead, broke the stream
+    uint64_t messages;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+static inline void
+mps_free(struct MPStream *s)
+{
+    if (s->init)
+        inflateEnd(&s->z);
+    for (int i = 0; i < MPS_REORDER; ++i)
+        free(s->ahead[i]);
+    free(s->buf);
+    memset(s, 0, sizeof(*s));
+}
+
+// the complete messages at the start of buf go to fn, the rest stays
+static inline void
+mps_messages(struct MPStream *s, mps_fn fn, void *arg)
+{
+    size_t pos = 0;
+    while (s->buf_len - pos >= MPS_MSG_HEADER) {
+        const uint8_t *m = s->buf + pos;
+        size_t len = (size_t)m[1] | (size_t)m[2] << 8;
+        if (len < MPS_MSG_HEADER) {
+            s->broken = true;
+            return;
+        }
+        if (s->buf_len - pos < len)
+            break;
+        s->messages++;
+        fn(arg, m[0], m + MPS_MSG_HEADER, len - MPS_MSG_HEADER);
+        pos += len;
+    }
+    memmove(s->buf, s->buf + pos, s->buf_len - pos);
+    s->buf_len -= pos;
+}
+
+static inline void
+mps_inflate(struct MPStream *s, const uint8_t *data, size_t len, mps_fn fn, void *arg)
+{
+    s->z.next_in = (Bytef *)data;
+    s->z.avail_in = (uInt)len;
+    s->bytes_in += len;
+    while (!s->broken) {
+        s->z.next_out = s->buf + s->buf_len;
+        s->z.avail_out = (uInt)(MPS_BUFFER - s->buf_len);
+        int rc = inflate(&s->z, Z_SYNC_FLUSH);
+        size_t out = (size_t)(MPS_BUFFER - s->buf_len) - s->z.avail_out;
+        s->buf_len += out;
+        s->bytes_out += out;
+        if (rc != Z_OK && rc != Z_BUF_ERROR && rc != Z_STREAM_END) {
+            s->broken = true;
+            return;
+        }
+        mps_messages(s, fn, arg);
+        // all input used and room left, inflate has nothing more until the next packet
+        if (s->z.avail_in == 0 && s->z.avail_out != 0)
+            return;
+        if (rc == Z_BUF_ERROR && out == 0)
+            return;
+        if (rc == Z_STREAM_END) {
+            inflateReset(&s->z);
+            if (s->z.avail_in == 0)
+                return;
+        }
+    }
+}
+
+// an MP_DAT of the direction, false - the stream is broken
+static inline bool
+mps_packet(struct MPStream *s, uint16_t seq, const uint8_t *data, size_t len, mps_fn fn, void *arg)
+{
+    if (s->broken)
+        return false;
+    if (!s->init) {
+        if ((s->buf = (uint8_t *)malloc(MPS_BUFFER)) == NULL ||
+            inflateInit2(&s->z, MPS_WBITS) != Z_OK) {
+            s->broken = true;
+            return false;
+        }
+        s->init = true;
+    }
+    if (!s->started) {
+        s->next = seq;
+        s->started = true;
+    }
+    s->packets++;
+    int16_t ahead = (int16_t)(seq - s->next);
+    if (ahead < 0 || (ahead > 0 && s->ahead[seq % MPS_REORDER])) {
+        s->resends++;
+        return true;
+    }
+    if (ahead >= MPS_REORDER) {
+        s->overflow++;
+        s->broken = true;
+        return false;
+    }
+    if (ahead > 0) {
+        uint8_t *copy = (uint8_t *)malloc(len ? len : 1);
+        if (!copy) {
+            s->overflow++;
+            s->broken = true;
+            return false;
+        }
+        memcpy(copy, data, len);
+        s->ahead[seq % MPS_REORDER] = copy;
+        s->ahead_len[seq % MPS_REORDER] = (uint16_t)len;
+        s->reordered++;
+        return true;
+    }
+    mps_inflate(s, data, len, fn, arg);
+    s->next++;
+    for (uint8_t *p; !s->broken && (p = s->ahead[s->next % MPS_REORDER]) != NULL; ) {
+        s->ahead[s->next % MPS_REORDER] = NULL;
+        mps_inflate(s, p, s->ahead_len[s->next % MPS_REORDER], fn, arg);
+        free(p);
+        s->next++;
+    }
+    return !s->broken;
+}
+
+#endif
@@ -0,0 +1,377 @@
+#include "mongoose.h"
+#include "tsc.h"
+#include <signal.h>
+
+#define PROXY_AUTH_DATA 0xF0
+#define PROXY_GAME_DATA 0xF4
+
+#define PROXY_HEADER_LEN 11
+struct ProxyHeader {
+    uint8_t type;
+    uint16_t len;
+    uint32_t from_id;
+    uint32_t to_id;
+    uint8_t data[0];
+} __attribute__((packed));
+
+#define BULK_BACKLOG (256 * 1024) // bytes a bulk sender keeps in its send buffer
+#define MP_DAT 4                    // frames look like game data to the relay
+#define MP_ACK 5
+#define MP_KPA 6
+#define KPA_INTERVAL 2000           // ms, like the game
+
+// --kpa frames, see MPHeader in gpgnet-mock.c
+struct MPHeader {
+    uint8_t type;
+    uint32_t mask;
+    uint16_t ser;
+    uint16_t irt;
+    uint16_t seq;
+    uint16_t expected;
+    uint16_t len;
+} __attribute__((packed));
+
+enum FrameKind {
+    FRAME_ECHO,     // echoed back to the pinger
+    FRAME_PING,     // echo it
+    FRAME_BULK,     // count and drop
+};
+
+// every frame carries the send time, the echo side sends it back unchanged
+struct BenchFrame {
+    uint8_t mp_type;
+    uint8_t echo;   // enum FrameKind
+    uint64_t sent_ns;
+} __attribute__((packed));
+
+struct Client {
+    uint32_t id;
+    uint32_t peer_id;
+    uint32_t game_id;
+    bool pinger;        // measure RTT, the partner only echoes frames
+    bool bulk;          // the pinger sends --bulk-size frames as fast as the relay takes them
+    bool authed;
+    int rate;
+    uint64_t next_send; // ms
+    int64_t read_credit;    // bytes, --read-rate
+    uint64_t last_refill;   // ms
+    uint16_t ser;           // --kpa
+    uint64_t next_kpa;      // ms
+    struct mg_connection *con;
+};
+
+struct Samples {
+    uint64_t *items;
+    size_t len;
+    size_t cap;
+};
+
+static int s_signo;
+static struct Client *s_clients;
+static struct Samples s_rtt;
+static uint64_t s_frames_sent;
+static uint64_t s_frames_recv;
+static size_t s_authed;
+static uint64_t s_bulk_recv;    // bytes
+static uint64_t s_kpa_sent;
+static uint64_t s_kpa_recv;     // let through by the relay
+static uint64_t s_ack_sent;
+static uint64_t s_ack_recv;
+// command line arguments
+static const char *s_url = "tcp://127.0.0.1:7788";
+static int s_pairs = 1;
+static int s_rate = 30;         // frames per second per pinger
+static int s_size = 64;         // frame payload size
+static int s_duration = 10;     // seconds
+static uint32_t s_first_id = 1000;
+static int s_game_size = 2;     // players per game, 0 - no games
+static int s_heavy_games = 0;   // the first games send at s_heavy_rate
+static int s_heavy_rate = 600;
+static int s_idle = 0;          // authenticate and stay silent, for the relay memory stats
+static int s_bulk = 0;          // bulk pairs after the interactive ones
+static int s_bulk_size = 32768;
+static int s_read_rate = 0;     // bytes per second the echo side reads, 0 - as fast as possible
+static int s_bulk_to_echo = 0;  // bulk senders share the link to the echo side of an interactive pair
+static int s_ping_ack = 0;      // pings and echoes are MP_ACK
+static int s_kpa = 0;           // idle game, MP_KPA every 2 seconds both ways instead of pings
+
+static void
+signal_handler(int signo)
+{
+    s_signo = signo;
+}
+
+static void
+samples_add(struct Samples *s, uint64_t v)
+{
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->items = realloc(s->items, s->cap * sizeof(s->items[0]));
+        if (!s->items) {
+            MG_ERROR(("OOM"));
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->items[s->len++] = v;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(struct Samples *s, double p)
+{
+    if (!s->len)
+        return 0;
+    size_t i = (size_t)(p * (double)(s->len - 1));
+    return (double)s->items[i] / 1000.0;
+}
+
+static void
+send_frame(struct Client *cl, uint8_t echo, uint64_t sent_ns)
+{
+    static uint8_t buf[PROXY_HEADER_LEN + 65535];
+    struct ProxyHeader *pkt = (struct ProxyHeader *)buf;
+    size_t size = (size_t)(cl->bulk ? s_bulk_size : s_size);
+    size_t len = size < sizeof(struct BenchFrame) ? sizeof(struct BenchFrame) : size;
+    pkt->type = PROXY_GAME_DATA;
+    pkt->len = (uint16_t)len;
+    pkt->from_id = cl->id;
+    pkt->to_id = cl->peer_id;
+    struct BenchFrame *f = (struct BenchFrame *)pkt->data;
+    f->mp_type = s_ping_ack && !cl->bulk ? MP_ACK : MP_DAT;
+    f->echo = echo;
+    f->sent_ns = sent_ns;
+    mg_send(cl->con, buf, PROXY_HEADER_LEN + len);
+    s_frames_sent++;
+}
+
+static void
+send_mp(struct Client *cl, uint8_t type, uint16_t irt)
+{
+    struct {
+        struct ProxyHeader pkt;
+        struct MPHeader mp;
+    } __attribute__((packed)) f = {
+        .pkt = { .type = PROXY_GAME_DATA, .len = sizeof(struct MPHeader), .from_id = cl->id, .to_id = cl->peer_id },
+        // no MP_DAT in flight, both sides expect what the other sends next
+        .mp = { .type = type, .ser = ++cl->ser, .irt = irt, .seq = 3, .expected = 3 },
+    };
+    mg_send(cl->con, &f, sizeof(f));
+}
+
+static void
+handle_frame(struct Client *cl, struct ProxyHeader *pkt)
+{
+    if (pkt->type == PROXY_AUTH_DATA) {
+        cl->authed = true;
+        s_authed++;
+        return;
+    }
+    if (s_kpa && pkt->len >= sizeof(struct MPHeader)) {
+        struct MPHeader *h = (struct MPHeader *)pkt->data;
+        if (h->type == MP_KPA) {
+            s_kpa_recv++;
+            s_ack_sent++;
+            send_mp(cl, MP_ACK, h->ser);
+        } else if (h->type == MP_ACK) {
+            s_ack_recv++;
+        }
+        return;
+    }
+    if (pkt->len < sizeof(struct BenchFrame))
+        return;
+    struct BenchFrame *f = (struct BenchFrame *)pkt->data;
+    if (f->echo == FRAME_BULK) {
+        s_bulk_recv += pkt->len;
+        return;
+    }
+    s_frames_recv++;
+    if (f->echo) {
+        send_frame(cl, 0, f->sent_ns);
+    } else if (cl->pinger) {
+        samples_add(&s_rtt, tsc_ns() - f->sent_ns);
+    }
+}
+
+static void
+client_fn(struct mg_connection *c, int ev, void *ev_data)
+{
+    struct Client *cl = (struct Client *)c->fn_data;
+    if (ev == MG_EV_CONNECT) {
+        struct ProxyHeader auth = {
+            .type = PROXY_AUTH_DATA,
+            .from_id = cl->id,
+            .to_id = cl->game_id,
+        };
+        mg_send(c, &auth, PROXY_HEADER_LEN);
+        if (s_read_rate && !cl->pinger) {
+            // no megabytes of loopback buffers between the relay and the slow reader
+            int size = 16384;
+            setsockopt((int)(size_t)c->fd, SOL_SOCKET, SO_RCVBUF, (char *)&size, sizeof(size));
+        }
+    } else if (ev == MG_EV_ERROR) {
+        MG_ERROR(("client %u: %s", cl->id, (char *)ev_data));
+    } else if (ev == MG_EV_CLOSE) {
+        cl->con = NULL;
+    } else if (ev == MG_EV_POLL) {
+        uint64_t now = *(uint64_t *)ev_data;
+        // a slow link, the relay sees the receive window close
+        if (s_read_rate && !cl->pinger) {
+            cl->read_credit += (int64_t)((now - cl->last_refill) * (uint64_t)s_read_rate / 1000);
+            if (cl->read_credit > s_read_rate / 10)
+                cl->read_credit = s_read_rate / 10;
+            cl->last_refill = now;
+            c->is_full = cl->read_credit <= 0;
+        }
+        // wait for everyone so the first samples don't include auth
+        if (s_kpa && s_authed == (size_t)(s_pairs + s_bulk) * 2 && now >= cl->next_kpa) {
+            // spread over the interval like unrelated games
+            cl->next_kpa = (cl->next_kpa ? cl->next_kpa : now + cl->id * 7919 % KPA_INTERVAL) + KPA_INTERVAL;
+            s_kpa_sent++;
+            send_mp(cl, MP_KPA, 0);
+        }
+        if (s_idle || s_kpa || !cl->pinger || s_authed < (size_t)(s_pairs + s_bulk) * 2)
+            return;
+        if (cl->bulk) {
+            while (c->send.len < BULK_BACKLOG)
+                send_frame(cl, FRAME_BULK, 0);
+            return;
+        }
+        if (now < cl->next_send)
+            return;
+        cl->next_send = now + 1000 / (uint64_t)cl->rate;
+        send_frame(cl, FRAME_PING, tsc_ns());
+    } else if (ev == MG_EV_READ) {
+        cl->read_credit -= *(long *)ev_data;
+        while (c->recv.len >= PROXY_HEADER_LEN) {
+            struct ProxyHeader *pkt = (struct ProxyHeader *)c->recv.buf;
+            size_t msg_len = PROXY_HEADER_LEN + pkt->len;
+            if (c->recv.len < msg_len)
+                break;
+            handle_frame(cl, pkt);
+            mg_iobuf_del(&c->recv, 0, msg_len);
+        }
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+        "%s usage:\n"
+        "--help                           show help message\n"
+        "--url arg                        relay url, default tcp://127.0.0.1:7788\n"
+        "--pairs n                        number of player pairs\n"
+        "--rate n                         frames per second sent by every pair\n"
+        "--size n                         frame payload size\n"
+        "--duration sec                   test duration\n"
+        "--first-id n                     first player id\n"
+        "--game-size n                    players per game, 0 - connect without a game\n"
+        "--heavy n                        the first n games send at --heavy-rate\n"
+        "--heavy-rate n                   frames per second sent by every pair of a heavy game\n"
+        "--idle                           connect and authenticate only, check the relay --stats\n"
+        "--bulk n                         add n pairs sending --bulk-size frames as fast as possible\n"
+        "--bulk-size n                    bulk frame payload size, default 32768\n"
+        "--read-rate n                    bytes per second the echo side of a pair reads\n"
+        "--bulk-to-echo                   bulk pairs send to the echo side of the interactive pairs\n"
+        "--ping-ack                       pings and echoes are MP_ACK instead of MP_DAT\n"
+        "--kpa                            idle games, every player sends MP_KPA every 2 seconds and acks the peer's\n",
+        prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    mg_log_set(MG_LL_INFO);
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    for (int i = 1; i < argc; i++) {
+        if (mg_casecmp("--url", argv[i]) == 0 && i + 1 < argc) {
+            s_url = argv[++i];
+        } else if (mg_casecmp("--pairs", argv[i]) == 0 && i + 1 < argc) {
+            s_pairs = atoi(argv[++i]);
+        } else if (mg_casecmp("--rate", argv[i]) == 0 && i + 1 < argc) {
+            s_rate = atoi(argv[++i]);
+        } else if (mg_casecmp("--size", argv[i]) == 0 && i + 1 < argc) {
+            s_size = atoi(argv[++i]);
+        } else if (mg_casecmp("--duration", argv[i]) == 0 && i + 1 < argc) {
+            s_duration = atoi(argv[++i]);
+        } else if (mg_casecmp("--game-size", argv[i]) == 0 && i + 1 < argc) {
+            s_game_size = atoi(argv[++i]);
+        } else if (mg_casecmp("--heavy", argv[i]) == 0 && i + 1 < argc) {
+            s_heavy_games = atoi(argv[++i]);
+        } else if (mg_casecmp("--heavy-rate", argv[i]) == 0 && i + 1 < argc) {
+            s_heavy_rate = atoi(argv[++i]);
+        } else if (mg_casecmp("--bulk", argv[i]) == 0 && i + 1 < argc) {
+            s_bulk = atoi(argv[++i]);
+        } else if (mg_casecmp("--bulk-size", argv[i]) == 0 && i + 1 < argc) {
+            s_bulk_size = atoi(argv[++i]);
+        } else if (mg_casecmp("--read-rate", argv[i]) == 0 && i + 1 < argc) {
+            s_read_rate = atoi(argv[++i]);
+        } else if (mg_casecmp("--bulk-to-echo", argv[i]) == 0) {
+            s_bulk_to_echo = 1;
+        } else if (mg_casecmp("--ping-ack", argv[i]) == 0) {
+            s_ping_ack = 1;
+        } else if (mg_casecmp("--kpa", argv[i]) == 0) {
+            s_kpa = 1;
+        } else if (mg_casecmp("--idle", argv[i]) == 0) {
+            s_idle = 1;
+        } else if (mg_casecmp("--first-id", argv[i]) == 0 && i + 1 < argc) {
+            s_first_id = (uint32_t)atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (s_game_size < 0 || s_game_size % 2 || s_pairs < 0 || s_bulk < 0 || s_pairs + s_bulk == 0 || (s_bulk_to_echo && !s_pairs) ||
+        s_bulk_size <= 0 || s_bulk_size > 65535 || s_rate <= 0 || s_rate > 1000 || s_heavy_rate <= 0 || s_heavy_rate > 1000 || s_size > 65535 || s_duration <= 0)
+        usage(argv[0]);
+    s_first_id &= ~1U; // pairs are (even, odd) ids
+    tsc_init();
+    struct mg_mgr mgr;
+    mg_mgr_init(&mgr);
+    if (s_read_rate)
+        mgr.io_budget = 4096; // small reads keep the rate smooth
+    s_clients = calloc((size_t)(s_pairs + s_bulk) * 2, sizeof(struct Client));
+    for (int i = 0; i < (s_pairs + s_bulk) * 2; ++i) {
+        struct Client *cl = &s_clients[i];
+        cl->bulk = i >= s_pairs * 2;
+        cl->id = s_first_id + (uint32_t)i;
+        cl->peer_id = cl->id ^ 1;
+        if (cl->bulk && s_bulk_to_echo)
+            cl->peer_id = s_first_id + (uint32_t)(i / 2 % s_pairs) * 2 + 1;
+        cl->pinger = (cl->id & 1) == 0;
+        cl->game_id = s_game_size ? cl->id / (uint32_t)s_game_size : 0;
+        cl->rate = s_game_size && i / s_game_size < s_heavy_games ? s_heavy_rate : s_rate;
+        cl->con = mg_connect(&mgr, s_url, client_fn, cl);
+    }
+    uint64_t start = mg_millis();
+    while (s_signo == 0 && mg_millis() - start < (uint64_t)s_duration * 1000) {
+        mg_mgr_poll(&mgr, 1);
+    }
+    qsort(s_rtt.items, s_rtt.len, sizeof(s_rtt.items[0]), cmp_u64);
+    printf("pairs=%d rate=%d size=%d authed=%zu sent=%llu recv=%llu samples=%zu\n",
+        s_pairs, s_rate, s_size, s_authed, (unsigned long long)s_frames_sent,
+        (unsigned long long)s_frames_recv, s_rtt.len);
+    printf("rtt us: p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+        percentile_us(&s_rtt, 0.5), percentile_us(&s_rtt, 0.9),
+        percentile_us(&s_rtt, 0.99), percentile_us(&s_rtt, 1.0));
+    if (s_kpa) {
+        // every MP_KPA let through and every MP_ACK of a player crossed the relay
+        printf("kpa sent=%llu relayed=%llu acks from the relay=%llu, relayed frames/s=%.1f\n",
+            (unsigned long long)s_kpa_sent, (unsigned long long)s_kpa_recv,
+            (unsigned long long)(s_ack_recv > s_ack_sent ? s_ack_recv - s_ack_sent : 0), (double)(s_kpa_recv + s_ack_sent) / s_duration);
+    }
+    if (s_bulk)
+        printf("bulk pairs=%d size=%d recv=%.1fMB/s\n", s_bulk, s_bulk_size,
+            (double)s_bulk_recv / s_duration / 1e6);
+    mg_mgr_free(&mgr);
+    free(s_clients);
+    free(s_rtt.items);
+    return 0;
+}
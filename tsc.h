@@ -0,0 +1,139 @@
+// Timestamps for the hot path, shared by the relay and the tools.
+//
+//   tsc_init()          calibrate once at startup, before starting threads
+//   tsc_ns()            monotonic nanoseconds without a syscall
+//   tsc_ticks()         raw counter, only ratios between two values mean something
+//   loop_clock_update() read tsc_ns() once per event loop iteration...
+//   loop_ns/loop_ms()   ...and use the cached value for the rest of it
+//
+// tsc_ns() scales rdtsc by a factor measured against CLOCK_MONOTONIC_RAW,
+// the clock behind mg_millis(). Without an invariant TSC (a constant rate,
+// synchronized between cores) it falls back to the OS clock.
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#define TSC_CALIBRATE_NS 20000000   // 20ms, the error is a few ppm
+
+static struct {
+    bool enabled;
+    uint64_t base_ticks;
+    uint64_t base_ns;
+    uint64_t mult;                  // ns per tick, 32.32 fixed point
+} s_tsc;
+
+static __thread uint64_t t_loop_ns;
+
+static inline uint64_t
+tsc_os_ns(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((unsigned long long)now.QuadPart / freq.QuadPart * 1000000000ULL +
+        (unsigned long long)now.QuadPart % freq.QuadPart * 1000000000ULL / freq.QuadPart);
+#else
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_RAW)
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#if defined(__x86_64__)
+// the tick count in the middle of an OS clock read, the narrowest of a few
+// tries, a slow read (the first vDSO call, an interrupt) skews the rate
+static inline uint64_t
+tsc_sample(uint64_t *ticks)
+{
+    uint64_t best = UINT64_MAX, ns = 0;
+    *ticks = 0;
+    for (int i = 0; i < 8; ++i) {
+        uint64_t before = __rdtsc();
+        uint64_t now = tsc_os_ns();
+        uint64_t width = __rdtsc() - before;
+        if (width < best) {
+            best = width;
+            ns = now;
+            *ticks = before + width / 2;
+        }
+    }
+    return ns;
+}
+#endif
+
+static inline bool
+tsc_init(void)
+{
+#if defined(__x86_64__)
+    unsigned a, b, c, d;
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1U << 8)))
+        return false;
+    uint64_t t0, t1;
+    uint64_t ns0 = tsc_sample(&t0), ns1;
+    do {
+        ns1 = tsc_sample(&t1);
+    } while (ns1 - ns0 < TSC_CALIBRATE_NS);
+    if (t1 <= t0)
+        return false;
+    s_tsc.mult = ((ns1 - ns0) << 32) / (t1 - t0);
+    s_tsc.base_ticks = t1;
+    s_tsc.base_ns = ns1;
+    s_tsc.enabled = true;
+#endif
+    return s_tsc.enabled;
+}
+
+static inline uint64_t
+tsc_ns(void)
+{
+#if defined(__x86_64__)
+    if (s_tsc.enabled)
+        return s_tsc.base_ns + (uint64_t)(((unsigned __int128)(__rdtsc() - s_tsc.base_ticks) * s_tsc.mult) >> 32);
+#endif
+    return tsc_os_ns();
+}
+
+static inline uint64_t
+tsc_ticks(void)
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return tsc_os_ns();
+#endif
+}
+
+static inline uint64_t
+loop_clock_update(void)
+{
+    return t_loop_ns = tsc_ns();
+}
+
+static inline uint64_t
+loop_ns(void)
+{
+    return t_loop_ns;
+}
+
+static inline uint64_t
+loop_ms(void)
+{
+    return t_loop_ns / 1000000;
+}
+
+#endif